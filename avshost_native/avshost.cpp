@@ -5,6 +5,7 @@
 #include <new>
 #include <tuple>
 #include <utility>
+#include <vector>
 #include <Windows.h>
 #include "ipc/ipc_client.h"
 #include "ipc/ipc_types.h"
@@ -188,7 +189,6 @@ ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip
 	constexpr int plane_order[3] = { PLANAR_Y, PLANAR_U, PLANAR_V };
 
 	ipc::VideoFrame ipc_frame{ { clip_id, n } };
-	size_t size = 0;
 
 	int num_planes = vi.IsPlanar() && !vi.IsY8() ? 3 : 1;
 
@@ -196,12 +196,9 @@ ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip
 		int rowsize = vi.RowSize(plane_order[p]);
 		ipc_frame.stride[p] = rowsize % 64 ? rowsize + 64 - rowsize % 64 : rowsize;
 		ipc_frame.height[p] = frame->GetHeight(plane_order[p]);
-
-		size += ipc_frame.stride[p] * ipc_frame.height[p];
 	}
 
-	unsigned char *dst_ptr = static_cast<unsigned char *>(client->allocate(size));
-	ipc_frame.heap_offset = client->pointer_to_offset(dst_ptr);
+	unsigned char *dst_ptr = static_cast<unsigned char *>(client->allocate_frame(&ipc_frame));
 
 	for (int p = 0; p < num_planes; ++p) {
 		int avs_plane = plane_order[p];
@@ -215,31 +212,52 @@ ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip
 } // namespace
 
 
+// Most recently used frames of the remote clips, from front to back.
 class Cache {
+public:
 	static constexpr size_t MEMORY_MAX = 8 * (1 << 20UL);
-
+	// Limit on the memory reserved to hold a batch of large frames.
+	static constexpr size_t BATCH_MEMORY_MAX = 256 * (1 << 20UL);
+private:
 	std::deque<std::tuple<uint32_t, int, ::PVideoFrame>> m_cache;
 	size_t m_memory_usage;
+	size_t m_memory_max;
 public:
-	Cache() : m_memory_usage{} {}
+	Cache() : m_memory_usage{}, m_memory_max{ MEMORY_MAX } {}
+
+	// Raise the memory limit to hold at least (size) bytes, up to
+	// BATCH_MEMORY_MAX.
+	void reserve(size_t size)
+	{
+		size = std::min(size, BATCH_MEMORY_MAX);
+		m_memory_max = std::max(m_memory_max, size);
+	}
 
 	void insert(uint32_t clip_id, int n, ::PVideoFrame frame)
 	{
 		size_t size = frame->GetFrameBuffer()->GetDataSize();
 
-		if (size > MEMORY_MAX)
+		if (size > m_memory_max)
 			return;
 
-		while (MEMORY_MAX - m_memory_usage < size) {
+		while (m_memory_max - m_memory_usage < size) {
 			::PVideoFrame frame = std::get<2>(m_cache.back());
 			m_cache.pop_back();
 			m_memory_usage -= frame->GetFrameBuffer()->GetDataSize();
 		}
 
-		m_cache.emplace_back(clip_id, n, frame);
+		m_cache.emplace_front(clip_id, n, frame);
 		m_memory_usage += size;
 	}
 
+	bool contains(uint32_t clip_id, int n) const
+	{
+		return std::any_of(m_cache.begin(), m_cache.end(), [=](const std::tuple<uint32_t, int, ::PVideoFrame> &x)
+		{
+			return std::get<0>(x) == clip_id && std::get<1>(x) == n;
+		});
+	}
+
 	::PVideoFrame find(uint32_t clip_id, int n)
 	{
 		auto it = std::find_if(m_cache.begin(), m_cache.end(), [=](const std::tuple<uint32_t, int, ::PVideoFrame> &x)
@@ -263,6 +281,7 @@ class VirtualClip : public ::IClip {
 	Cache *m_cache;
 	uint32_t m_clip_id;
 	::VideoInfo m_vi;
+	ipc_client::FrameBatchSize m_batch_size;
 public:
 	VirtualClip(ipc_client::IPCClient *client, Cache *cache, uint32_t clip_id, const ::VideoInfo &vi) :
 		m_client{ client },
@@ -274,29 +293,64 @@ public:
 	::PVideoFrame __stdcall GetFrame(int n, ::IScriptEnvironment *env) override
 	{
 		::PVideoFrame frame = m_cache->find(m_clip_id, n);
+		if (frame)
+			return frame;
+
+		// Request the frames that follow while access is sequential, as many as
+		// fit in half of the free space of the master heap, where they are
+		// sent. The cache is grown to hold the batch.
+		size_t frame_size = m_vi.BMPSize() > 0 ? m_vi.BMPSize() : 1;
+		ipc::HeapStats stats = m_client->master_heap_stats();
+		size_t free_bytes = stats.bytes_in_use < stats.capacity ? stats.capacity - stats.bytes_in_use : 0;
+		size_t max_batch = std::min(free_bytes / 2, Cache::BATCH_MEMORY_MAX) / frame_size;
+		uint32_t count = m_batch_size.next(n, static_cast<uint32_t>(std::min(max_batch, static_cast<size_t>(ipc_client::MAX_FRAME_BATCH))));
+		m_cache->reserve(count * frame_size);
+
+		std::vector<ipc::VideoFrameRequest> requests{ { m_clip_id, n } };
+		for (int i = n + 1; i < n + static_cast<int>(count) && i < m_vi.num_frames; ++i) {
+			if (!m_cache->contains(m_clip_id, i))
+				requests.push_back({ m_clip_id, i });
+		}
+
+		ipc_log("clip %u frame %d not prefetched, request %zu frames\n", m_clip_id, n, requests.size());
+
+		auto response = m_client->send_sync(std::make_unique<ipc_client::CommandGetFrames>(requests), ipc_client::Priority::URGENT);
+
+		// The batch fails as a whole if any of its frames fails, or if they do
+		// not all fit in the heap. Retry frame (n) on its own.
+		if (requests.size() > 1 && response && response->type() == ipc_client::CommandType::ERR) {
+			ipc_log("clip %u batch at frame %d failed, request it alone\n", m_clip_id, n);
+			response->deallocate_heap_resources(m_client);
+			m_batch_size.reset();
+			requests.resize(1);
+			response = m_client->send_sync(std::make_unique<ipc_client::CommandGetFrames>(requests), ipc_client::Priority::URGENT);
+		}
 
-		if (!frame) {
-			ipc_log("clip %u frame %d not prefetched\n", m_clip_id, n);
+		try {
+			if (!response || response->type() != ipc_client::CommandType::SET_FRAMES)
+				env->ThrowError("remote get frame failed");
 
-			auto response = m_client->send_sync(std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ m_clip_id, n }));
-			try {
-				if (!response || response->type() != ipc_client::CommandType::SET_FRAME)
-					env->ThrowError("remote get frame failed");
+			const std::vector<ipc::VideoFrame> &frames = static_cast<ipc_client::CommandSetFrames *>(response.get())->arg();
+			if (frames.size() != requests.size())
+				env->ThrowError("remote get frame returned wrong number of frames");
 
-				ipc_client::CommandSetFrame *set_frame = static_cast<ipc_client::CommandSetFrame *>(response.get());
-				if (set_frame->arg().request.clip_id != m_clip_id || set_frame->arg().request.frame_number != n)
+			for (size_t i = 0; i < frames.size(); ++i) {
+				if (frames[i].request.clip_id != m_clip_id || frames[i].request.frame_number != requests[i].frame_number)
 					env->ThrowError("remote get frame returned wrong frame");
 
-				frame = heap_to_local_frame(m_client, m_vi, set_frame->arg(), env);
-				m_cache->insert(m_clip_id, n, frame);
-			} catch (...) {
-				response->deallocate_heap_resources(m_client);
-				throw;
-			}
+				::PVideoFrame local_frame = heap_to_local_frame(m_client, m_vi, frames[i], env);
+				m_cache->insert(m_clip_id, requests[i].frame_number, local_frame);
 
-			response->deallocate_heap_resources(m_client);
+				if (!i)
+					frame = local_frame;
+			}
+		} catch (...) {
+			if (response)
+				response->deallocate_heap_resources(m_client);
+			throw;
 		}
 
+		response->deallocate_heap_resources(m_client);
 		return frame;
 	}
 
@@ -535,41 +589,22 @@ int AvisynthHost::observe(std::unique_ptr<ipc_client::CommandEvalScript> c)
 
 int AvisynthHost::observe(std::unique_ptr<ipc_client::CommandGetFrame> c)
 {
-	CHECK_AVS_LOADED(c);
-
-	ipc_log("GetFrame clip %u frame %u\n", c->arg().clip_id, c->arg().frame_number);
+	ipc_client::FrameRequests requests{ ipc_client::CommandType::GET_FRAME, c->transaction_id(), 1 };
+	requests.requests[0] = c->arg();
+	return get_frames(requests);
+}
 
-	COMMAND_EX_BEGIN
-	auto it = m_local_clips.find(c->arg().clip_id);
-	if (it == m_local_clips.end()) {
-		ipc_log0("invalid local clip id\n");
+int AvisynthHost::observe(std::unique_ptr<ipc_client::CommandGetFrames> c)
+{
+	if (c->arg().empty() || c->arg().size() > ipc_client::MAX_FRAME_BATCH) {
+		ipc_log("invalid number of frames requested: %zu\n", c->arg().size());
 		send_err(c->transaction_id());
 		return 1;
 	}
 
-	AVS_EX_BEGIN
-	const ::PClip &clip = it->second.get();
-	::PVideoFrame frame = clip->GetFrame(c->arg().frame_number, m_env.get());
-	ipc::VideoFrame ipc_frame = local_to_heap_frame(m_client, c->arg().clip_id, c->arg().frame_number, clip->GetVideoInfo(), frame, m_env.get());
-	std::unique_ptr<ipc_client::Command> result;
-
-	try {
-		result = std::make_unique<ipc_client::CommandSetFrame>(ipc_frame);
-		ipc_frame.heap_offset = ipc::NULL_OFFSET;
-	} catch (...) {
-		result->deallocate_heap_resources(m_client);
-		m_client->deallocate(m_client->offset_to_pointer(ipc_frame.heap_offset));
-		throw;
-	}
-
-	if (c->transaction_id() != ipc_client::INVALID_TRANSACTION)
-		result->set_response_id(c->transaction_id());
-
-	m_client->send_async(std::move(result));
-	AVS_EX_END
-	COMMAND_EX_END
-
-	return 1;
+	ipc_client::FrameRequests requests{ ipc_client::CommandType::GET_FRAMES, c->transaction_id(), static_cast<uint32_t>(c->arg().size()) };
+	std::copy(c->arg().begin(), c->arg().end(), requests.requests);
+	return get_frames(requests);
 }
 
 int AvisynthHost::observe(std::unique_ptr<ipc_client::CommandSetFrame> c)
@@ -597,6 +632,64 @@ int AvisynthHost::observe(std::unique_ptr<ipc_client::CommandSetFrame> c)
 	return 0;
 }
 
+int AvisynthHost::get_frames(const ipc_client::FrameRequests &requests)
+{
+	if (!m_library) {
+		ipc_log("received command type %d before Avisynth loaded\n", requests.type);
+		send_err(requests.transaction_id);
+		return 1;
+	}
+
+	ipc_log("GetFrames clip %u frame %d, %u frames\n", requests.requests[0].clip_id, requests.requests[0].frame_number, requests.count);
+
+	const ::PClip *clips[ipc_client::MAX_FRAME_BATCH];
+
+	for (uint32_t i = 0; i < requests.count; ++i) {
+		auto it = m_local_clips.find(requests.requests[i].clip_id);
+		if (it == m_local_clips.end()) {
+			ipc_log0("invalid local clip id\n");
+			send_err(requests.transaction_id);
+			return 1;
+		}
+		clips[i] = &it->second.get();
+	}
+
+	ipc::VideoFrame frames[ipc_client::MAX_FRAME_BATCH];
+	uint32_t count = 0;
+
+	AVS_EX_BEGIN
+	try {
+		for (; count < requests.count; ++count) {
+			const ipc::VideoFrameRequest &request = requests.requests[count];
+			const ::PClip &clip = *clips[count];
+			::PVideoFrame frame = clip->GetFrame(request.frame_number, m_env.get());
+			frames[count] = local_to_heap_frame(m_client, request.clip_id, request.frame_number, clip->GetVideoInfo(), frame, m_env.get());
+		}
+	} catch (...) {
+		for (uint32_t i = 0; i < count; ++i) {
+			m_client->deallocate_frame(frames[i]);
+		}
+		throw;
+	}
+	AVS_EX_END
+
+	if (requests.type == ipc_client::CommandType::GET_FRAME) {
+		ipc_client::CommandSetFrame result{ frames[0] };
+		if (requests.transaction_id != ipc_client::INVALID_TRANSACTION)
+			result.set_response_id(requests.transaction_id);
+
+		m_client->send_async(result);
+	} else {
+		ipc_client::CommandSetFrames result{ std::vector<ipc::VideoFrame>(frames, frames + count) };
+		if (requests.transaction_id != ipc_client::INVALID_TRANSACTION)
+			result.set_response_id(requests.transaction_id);
+
+		m_client->send_async(result);
+	}
+
+	return 1;
+}
+
 void AvisynthHost::send_avsvalue(uint32_t response_id, const ::AVSValue &avs_value)
 {
 	if (response_id == ipc_client::INVALID_TRANSACTION)
@@ -648,9 +741,9 @@ void AvisynthHost::send_err(uint32_t response_id)
 	if (response_id == ipc_client::INVALID_TRANSACTION)
 		return;
 
-	auto response = std::make_unique<ipc_client::CommandErr>();
-	response->set_response_id(response_id);
-	m_client->send_async(std::move(response));
+	ipc_client::CommandErr response;
+	response.set_response_id(response_id);
+	m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
 }
 
 } // namespace avs
@@ -75,6 +75,7 @@ class AvisynthHost : public ipc_client::CommandObserver {
 	int observe(std::unique_ptr<ipc_client::CommandGetScriptVar> c) override;
 	int observe(std::unique_ptr<ipc_client::CommandEvalScript> c) override;
 	int observe(std::unique_ptr<ipc_client::CommandGetFrame> c) override;
+	int observe(std::unique_ptr<ipc_client::CommandGetFrames> c) override;
 	int observe(std::unique_ptr<ipc_client::CommandSetFrame> c) override;
 
 	void send_avsvalue(uint32_t response_id, const ::AVSValue &avs_value);
@@ -84,6 +85,10 @@ public:
 	explicit AvisynthHost(ipc_client::IPCClient *client);
 
 	~AvisynthHost();
+
+	// Serve a GET_FRAME or GET_FRAMES request decoded in place. Returns 1 once
+	// the response has been sent.
+	int get_frames(const ipc_client::FrameRequests &requests);
 };
 
 } // namespace avs
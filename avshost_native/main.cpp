@@ -2,12 +2,12 @@
 #include <condition_variable>
 #include <cstdint>
 #include <cstdio>
-#include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 #include <Windows.h>
 #include "ipc/ipc_client.h"
 #include "ipc/ipc_commands.h"
@@ -24,7 +24,14 @@ class Session : ipc_client::CommandObserver {
 	avs::AvisynthHost m_avs;
 	std::mutex m_mutex;
 	std::condition_variable m_cond;
-	std::deque<std::unique_ptr<ipc_client::Command>> m_queue;
+	// A received command, or frame requests decoded in place by the receiver
+	// thread if there is no command.
+	struct QueuedCommand {
+		std::unique_ptr<ipc_client::Command> command;
+		ipc_client::FrameRequests frame_requests;
+	};
+
+	std::vector<QueuedCommand> m_queue;
 	std::atomic_bool m_exit_flag;
 
 	static void log_to_file(const char *fmt, va_list va)
@@ -55,6 +62,7 @@ class Session : ipc_client::CommandObserver {
 	AVS_OBSERVE(ipc_client::CommandSetScriptVar)
 	AVS_OBSERVE(ipc_client::CommandEvalScript)
 	AVS_OBSERVE(ipc_client::CommandGetFrame)
+	AVS_OBSERVE(ipc_client::CommandGetFrames)
 	AVS_OBSERVE(ipc_client::CommandSetFrame)
 #undef AVS_OBSERVE
 
@@ -62,13 +70,51 @@ class Session : ipc_client::CommandObserver {
 	{
 		std::unique_lock<std::mutex> lock{ m_mutex };
 
-		if (command)
-			m_queue.emplace_back(std::move(command));
-		else
+		if (command) {
+			m_queue.emplace_back();
+			m_queue.back().command = std::move(command);
+		} else {
 			m_exit_flag = true;
+		}
+
+		lock.unlock();
+		m_cond.notify_all();
+	}
+
+	// Handle commands that need no allocation on the receiver thread. Frame
+	// requests are copied for the session thread, and responses that nobody
+	// waits for are dropped.
+	bool queue_view(const ipc_client::CommandView &view)
+	{
+		if (view.type() == ipc_client::CommandType::ACK || view.type() == ipc_client::CommandType::ERR)
+			return true;
 
+		ipc_client::FrameRequests requests;
+		if (!ipc_client::read_frame_requests(view, &requests))
+			return false;
+
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		m_queue.emplace_back();
+		m_queue.back().frame_requests = requests;
 		lock.unlock();
 		m_cond.notify_all();
+		return true;
+	}
+
+	void run_command(QueuedCommand &queued)
+	{
+		uint32_t transaction_id = queued.command ? queued.command->transaction_id() : queued.frame_requests.transaction_id;
+
+		try {
+			int ret = queued.command ? dispatch(std::move(queued.command)) : m_avs.get_frames(queued.frame_requests);
+			if (!ret && transaction_id != ipc_client::INVALID_TRANSACTION)
+				send_ack(transaction_id);
+		} catch (const ipc_client::IPCError &) {
+			throw;
+		} catch (...) {
+			send_err(transaction_id);
+			ipc_log_current_exception();
+		}
 	}
 
 	void send_ack(uint32_t response_id)
@@ -76,9 +122,9 @@ class Session : ipc_client::CommandObserver {
 		if (response_id == ipc_client::INVALID_TRANSACTION)
 			return;
 
-		auto response = std::make_unique<ipc_client::CommandAck>();
-		response->set_response_id(response_id);
-		m_client->send_async(std::move(response));
+		ipc_client::CommandAck response;
+		response.set_response_id(response_id);
+		m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
 	}
 
 	void send_err(uint32_t response_id)
@@ -86,9 +132,9 @@ class Session : ipc_client::CommandObserver {
 		if (response_id == ipc_client::INVALID_TRANSACTION)
 			return;
 
-		auto response = std::make_unique<ipc_client::CommandErr>();
-		response->set_response_id(response_id);
-		m_client->send_async(std::move(response));
+		ipc_client::CommandErr response;
+		response.set_response_id(response_id);
+		m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
 	}
 public:
 	explicit Session(ipc_client::IPCClient *client) :
@@ -105,7 +151,11 @@ public:
 
 	void run_loop()
 	{
-		m_client->start(std::bind(&Session::queue_command, this, std::placeholders::_1));
+		m_client->start(std::bind(&Session::queue_command, this, std::placeholders::_1), std::bind(&Session::queue_view, this, std::placeholders::_1));
+
+		// Both vectors keep their capacity, so queueing commands does not
+		// allocate once they have grown.
+		std::vector<QueuedCommand> commands;
 
 		while (true) {
 			std::unique_lock<std::mutex> lock{ m_mutex };
@@ -116,22 +166,13 @@ public:
 				break;
 			}
 
-			std::unique_ptr<ipc_client::Command> command = std::move(m_queue.front());
-			m_queue.pop_front();
+			commands.swap(m_queue);
 			lock.unlock();
 
-			uint32_t transaction_id = command->transaction_id();
-
-			try {
-				int ret = dispatch(std::move(command));
-				if (!ret && transaction_id != ipc_client::INVALID_TRANSACTION)
-					send_ack(transaction_id);
-			} catch (const ipc_client::IPCError &) {
-				throw;
-			} catch (...) {
-				send_err(transaction_id);
-				ipc_log_current_exception();
+			for (QueuedCommand &queued : commands) {
+				run_command(queued);
 			}
+			commands.clear();
 		}
 	}
 };
@@ -1,15 +1,18 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdint>
 #include <deque>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <Windows.h>
 #include "ipc/ipc_client.h"
 #include "ipc/ipc_commands.h"
 #include "ipc/ipc_types.h"
+#include "ipc/logging.h"
 #include "ipc/video_types.h"
 #include "ipc/win32util.h"
 #include "p2p_api.h"
@@ -24,6 +27,16 @@ constexpr char PLUGIN_ID[] = "xxx.abc.avsproxy";
 
 constexpr size_t MAX_STR_LEN = 1UL << 20;
 
+// Default sizing of the IPC heaps and queues. Each heap holds the given number
+// of frames from every injected clip, on top of ipc_client::DEFAULT_HEAP_SIZE.
+constexpr int64_t DEFAULT_INFLIGHT_FRAMES = 8;
+constexpr int64_t MAX_INFLIGHT_FRAMES = 1024;
+constexpr int64_t QUEUE_SIZE_PER_FRAME = 128;
+
+// The output format is not known until the script is evaluated, so both heaps
+// are warmed up for the in-flight input frames, plus one large output frame.
+constexpr int64_t WARM_UP_SIZE_BASE = 32 * (1LL << 20);
+
 
 std::wstring utf8_to_utf16(const std::string &s)
 {
@@ -230,27 +243,30 @@ Frame heap_to_local_frame(ipc_client::IPCClient *client, const ::VSVideoInfo &vi
 	return frame;
 }
 
-ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip_id, int32_t n, const ::VSVideoInfo &vi, const ConstFrame &frame)
+// Layout of a frame in the IPC heap. RGB is packed into a single plane.
+ipc::VideoFrame heap_frame_layout(uint32_t clip_id, int32_t n, const ::VSVideoInfo &vi)
 {
 	ipc::VideoFrame ipc_frame{ { clip_id, n } };
-	size_t size = 0;
 
 	if (vi.format.colorFamily == ::cfRGB) {
 		int rowsize = vi.width * 4;
 		ipc_frame.stride[0] = rowsize % 64 ? rowsize + 64 - rowsize % 64 : rowsize;
 		ipc_frame.height[0] = vi.height;
-		size = ipc_frame.stride[0] * vi.height;
 	} else {
 		for (int p = 0; p < vi.format.numPlanes; ++p) {
-			int rowsize = frame.width(p);
+			int rowsize = (vi.width >> (p ? vi.format.subSamplingW : 0)) * vi.format.bytesPerSample;
 			ipc_frame.stride[p] = rowsize % 64 ? rowsize + 64 - rowsize % 64 : rowsize;
-			ipc_frame.height[p] = frame.height(p);
-			size += ipc_frame.stride[p] * ipc_frame.height[p];
+			ipc_frame.height[p] = vi.height >> (p ? vi.format.subSamplingH : 0);
 		}
 	}
 
-	unsigned char *dst_ptr = static_cast<unsigned char *>(client->allocate(size));
-	ipc_frame.heap_offset = client->pointer_to_offset(dst_ptr);
+	return ipc_frame;
+}
+
+ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip_id, int32_t n, const ::VSVideoInfo &vi, const ConstFrame &frame)
+{
+	ipc::VideoFrame ipc_frame = heap_frame_layout(clip_id, n, vi);
+	unsigned char *dst_ptr = static_cast<unsigned char *>(client->allocate_frame(&ipc_frame));
 
 	if (vi.format.colorFamily == ::cfRGB) {
 		ConstFrame alpha = frame.frame_props_ro().get_prop<ConstFrame>("_Alpha", map::Ignore{});
@@ -285,15 +301,81 @@ ipc::VideoFrame local_to_heap_frame(ipc_client::IPCClient *client, uint32_t clip
 	return ipc_frame;
 }
 
+
+// Frames recently sent to the slave, kept on the heap so that repeated requests
+// for the same frame share one copy. Holds a reference to each frame.
+class SentFrameCache {
+	std::deque<ipc::VideoFrame> m_frames;
+	size_t m_capacity;
+public:
+	explicit SentFrameCache(size_t capacity = 0) : m_capacity{ capacity } {}
+
+	void set_capacity(size_t capacity) { m_capacity = capacity; }
+
+	// Find a cached frame and add a reference to it for the caller.
+	bool find(ipc_client::IPCClient *client, const ipc::VideoFrameRequest &request, ipc::VideoFrame *frame)
+	{
+		auto it = std::find_if(m_frames.begin(), m_frames.end(), [&](const ipc::VideoFrame &x)
+		{
+			return x.request.clip_id == request.clip_id && x.request.frame_number == request.frame_number;
+		});
+
+		if (it == m_frames.end())
+			return false;
+
+		client->retain(client->offset_to_pointer(it->heap_offset));
+		*frame = *it;
+
+		ipc::VideoFrame val = *it;
+		m_frames.erase(it);
+		m_frames.push_front(val);
+		return true;
+	}
+
+	// Add a reference to a frame and cache it, evicting the oldest frames.
+	void insert(ipc_client::IPCClient *client, const ipc::VideoFrame &frame)
+	{
+		if (!m_capacity)
+			return;
+
+		while (m_frames.size() >= m_capacity) {
+			client->deallocate_frame(m_frames.back());
+			m_frames.pop_back();
+		}
+
+		client->retain(client->offset_to_pointer(frame.heap_offset));
+		m_frames.push_front(frame);
+	}
+
+	void clear(ipc_client::IPCClient *client)
+	{
+		while (!m_frames.empty()) {
+			client->deallocate_frame(m_frames.back());
+			m_frames.pop_back();
+		}
+	}
+};
+
 } // namespace
 
 
 class AVSProxy : public FilterBase {
 	std::unique_ptr<ipc_client::IPCClient> m_client;
 	std::unordered_map<uint32_t, FilterNode> m_clips;
+	SentFrameCache m_sent_frames;
 	ipc::Value m_script_result;
 	::VSVideoInfo m_vi;
 
+	// Output frames received ahead of being requested, in the slave heap.
+	std::deque<ipc::VideoFrame> m_output_frames;
+	ipc_client::FrameBatchSize m_output_batch;
+	uint32_t m_max_output_batch;
+	uint32_t m_output_frame_size;
+
+	// Frame requests from the slave, decoded in place by the receiver thread.
+	std::vector<ipc_client::FrameRequests> m_frame_requests;
+	std::vector<ipc_client::FrameRequests> m_serviced_frame_requests;
+
 	std::deque<std::unique_ptr<ipc_client::Command>> m_command_queue;
 	std::unique_ptr<ipc_client::Command> m_runloop_response;
 	std::mutex m_mutex;
@@ -302,6 +384,9 @@ class AVSProxy : public FilterBase {
 	std::atomic_bool m_runloop_response_received;
 	std::atomic_bool m_remote_exit;
 
+	std::chrono::steady_clock::time_point m_init_time;
+	std::atomic_bool m_first_frame_done;
+
 	void fatal()
 	{
 		m_client->stop();
@@ -340,11 +425,32 @@ class AVSProxy : public FilterBase {
 		m_cond.notify_all();
 	}
 
+	// Handle commands that need no allocation on the receiver thread. Frame
+	// requests are copied for the runloop, and responses that nobody waits for
+	// are dropped.
+	bool recv_view_callback(const ipc_client::CommandView &view)
+	{
+		if (view.type() == ipc_client::CommandType::ACK || view.type() == ipc_client::CommandType::ERR)
+			return true;
+
+		ipc_client::FrameRequests requests;
+		if (!ipc_client::read_frame_requests(view, &requests))
+			return false;
+
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		m_frame_requests.push_back(requests);
+		lock.unlock();
+		m_cond.notify_all();
+		return true;
+	}
+
 	void runloop_callback(uint32_t request, std::unique_ptr<ipc_client::Command> c)
 	{
 		if (request != m_active_request) {
-			c->deallocate_heap_resources(m_client.get());
-			send_err(c->transaction_id());
+			if (c) {
+				c->deallocate_heap_resources(m_client.get());
+				send_err(c->transaction_id());
+			}
 			return;
 		}
 
@@ -362,9 +468,9 @@ class AVSProxy : public FilterBase {
 		if (response_id == ipc_client::INVALID_TRANSACTION)
 			return;
 
-		auto response = std::make_unique<ipc_client::CommandAck>();
-		response->set_response_id(response_id);
-		m_client->send_async(std::move(response));
+		ipc_client::CommandAck response;
+		response.set_response_id(response_id);
+		m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
 	}
 
 	void send_err(uint32_t response_id)
@@ -372,9 +478,9 @@ class AVSProxy : public FilterBase {
 		if (response_id == ipc_client::INVALID_TRANSACTION)
 			return;
 
-		auto response = std::make_unique<ipc_client::CommandErr>();
-		response->set_response_id(response_id);
-		m_client->send_async(std::move(response));
+		ipc_client::CommandErr response;
+		response.set_response_id(response_id);
+		m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
 	}
 
 	void expect_ack(std::unique_ptr<ipc_client::Command> c)
@@ -400,39 +506,83 @@ class AVSProxy : public FilterBase {
 			m_command_queue.pop_front();
 			reject(std::move(c));
 		}
+
+		for (const ipc_client::FrameRequests &requests : m_frame_requests) {
+			send_err(requests.transaction_id);
+		}
+		m_frame_requests.clear();
 	}
 
-	void service_remote_getframe(std::unique_ptr<ipc_client::CommandGetFrame> c)
+	// Copy a frame of an injected clip to the heap, or share the copy that was
+	// already sent. Returns false if the frame can not be produced.
+	bool heap_frame(const ipc::VideoFrameRequest &request, ipc::VideoFrame *ipc_frame)
 	{
-		auto it = m_clips.find(c->arg().clip_id);
-		if (it == m_clips.end()) {
-			c->deallocate_heap_resources(m_client.get());
-			send_err(c->transaction_id());
-			return;
-		}
+		auto it = m_clips.find(request.clip_id);
+		if (it == m_clips.end())
+			return false;
+
+		if (m_sent_frames.find(m_client.get(), request, ipc_frame))
+			return true;
 
 		ConstFrame frame;
 
 		try {
-			frame = it->second.get_frame(c->arg().frame_number);
+			frame = it->second.get_frame(request.frame_number);
 		} catch (...) {
-			c->deallocate_heap_resources(m_client.get());
-			send_err(c->transaction_id());
-			return;
+			return false;
 		}
 
-		ipc::VideoFrame ipc_frame = local_to_heap_frame(m_client.get(), c->arg().clip_id, c->arg().frame_number, it->second.video_info(), frame);
-		std::unique_ptr<ipc_client::Command> response;
+		*ipc_frame = local_to_heap_frame(m_client.get(), request.clip_id, request.frame_number, it->second.video_info(), frame);
+
+		try {
+			m_sent_frames.insert(m_client.get(), *ipc_frame);
+		} catch (...) {
+			m_client->deallocate_frame(*ipc_frame);
+			throw;
+		}
+
+		return true;
+	}
+
+	void service_remote_frames(const ipc_client::FrameRequests &requests)
+	{
+		std::vector<ipc::VideoFrame> frames;
+		bool success = true;
 
 		try {
-			response = std::make_unique<ipc_client::CommandSetFrame>(ipc_frame);
+			frames.reserve(requests.count);
+
+			for (uint32_t i = 0; success && i < requests.count; ++i) {
+				ipc::VideoFrame ipc_frame;
+				success = heap_frame(requests.requests[i], &ipc_frame);
+				if (success)
+					frames.push_back(ipc_frame);
+			}
 		} catch (...) {
-			m_client->deallocate(m_client->offset_to_pointer(ipc_frame.heap_offset));
+			for (const ipc::VideoFrame &frame : frames) {
+				m_client->deallocate_frame(frame);
+			}
 			throw;
 		}
 
-		response->set_response_id(c->transaction_id());
-		m_client->send_async(std::move(response));
+		if (!success) {
+			for (const ipc::VideoFrame &frame : frames) {
+				m_client->deallocate_frame(frame);
+			}
+			send_err(requests.transaction_id);
+			return;
+		}
+
+		// The remote thread is blocked on the frames.
+		if (requests.type == ipc_client::CommandType::GET_FRAME) {
+			ipc_client::CommandSetFrame response{ frames.front() };
+			response.set_response_id(requests.transaction_id);
+			m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
+		} else {
+			ipc_client::CommandSetFrames response{ std::move(frames) };
+			response.set_response_id(requests.transaction_id);
+			m_client->send_async(response, nullptr, ipc_client::Priority::URGENT);
+		}
 	}
 
 	std::unique_ptr<ipc_client::Command> runloop(std::unique_ptr<ipc_client::Command> c)
@@ -447,10 +597,16 @@ class AVSProxy : public FilterBase {
 
 		m_runloop_response.reset();
 		m_runloop_response_received = false;
-		m_client->send_async(std::move(c), std::bind(&AVSProxy::runloop_callback, this, ++m_active_request, std::placeholders::_1));
+		uint32_t request = ++m_active_request;
+
+		// If the session has ended, the callback runs on this thread and
+		// takes the mutex.
+		lock.unlock();
+		m_client->send_async(std::move(c), std::bind(&AVSProxy::runloop_callback, this, request, std::placeholders::_1));
+		lock.lock();
 
 		while (true) {
-			m_cond.wait(lock, [&]() { return m_remote_exit || m_runloop_response_received || !m_command_queue.empty(); });
+			m_cond.wait(lock, [&]() { return m_remote_exit || m_runloop_response_received || !m_frame_requests.empty() || !m_command_queue.empty(); });
 
 			if (m_remote_exit)
 				throw std::runtime_error{ "remote process exited" };
@@ -458,19 +614,30 @@ class AVSProxy : public FilterBase {
 			if (m_runloop_response_received)
 				break;
 
-			while (!m_command_queue.empty()) {
-				std::unique_ptr<ipc_client::Command> c{ std::move(m_command_queue.front()) };
-				m_command_queue.pop_front();
+			// Both vectors keep their capacity, so serving frames does not
+			// allocate once they have grown.
+			while (!m_frame_requests.empty()) {
+				m_serviced_frame_requests.swap(m_frame_requests);
 				lock.unlock();
 
-				if (c->type() != ipc_client::CommandType::GET_FRAME) {
-					reject(std::move(c));
-					lock.lock();
-					continue;
+				try {
+					for (const ipc_client::FrameRequests &requests : m_serviced_frame_requests) {
+						service_remote_frames(requests);
+					}
+				} catch (...) {
+					m_serviced_frame_requests.clear();
+					throw;
 				}
 
-				std::unique_ptr<ipc_client::CommandGetFrame> get{ static_cast<ipc_client::CommandGetFrame *>(c.release()) };
-				service_remote_getframe(std::move(get));
+				m_serviced_frame_requests.clear();
+				lock.lock();
+			}
+
+			while (!m_command_queue.empty()) {
+				std::unique_ptr<ipc_client::Command> c{ std::move(m_command_queue.front()) };
+				m_command_queue.pop_front();
+				lock.unlock();
+				reject(std::move(c));
 				lock.lock();
 			}
 		}
@@ -481,15 +648,102 @@ class AVSProxy : public FilterBase {
 
 		return std::move(m_runloop_response);
 	}
+
+	void clear_output_frames()
+	{
+		while (!m_output_frames.empty()) {
+			m_client->deallocate_frame(m_output_frames.back());
+			m_output_frames.pop_back();
+		}
+	}
+
+	// Request output frame (n) from the slave, along with the frames that
+	// follow while requests are sequential. The other frames are kept for
+	// later calls.
+	ipc::VideoFrame fetch_output_frame(int n)
+	{
+		auto it = std::find_if(m_output_frames.begin(), m_output_frames.end(), [=](const ipc::VideoFrame &x) { return x.request.frame_number == n; });
+		if (it != m_output_frames.end()) {
+			ipc::VideoFrame ipc_frame = *it;
+			m_output_frames.erase(it);
+			return ipc_frame;
+		}
+
+		// Frames from before a seek are not going to be used.
+		clear_output_frames();
+
+		// Only request as many frames as fit in half of the free space of the
+		// slave heap, which also holds the frames of the slave's own clips.
+		ipc::HeapStats stats = m_client->slave_heap_stats();
+		uint32_t free_bytes = stats.bytes_in_use < stats.capacity ? stats.capacity - stats.bytes_in_use : 0;
+		uint32_t max_batch = std::min(m_max_output_batch, free_bytes / 2 / std::max(m_output_frame_size, 1U));
+
+		uint32_t count = m_output_batch.next(n, max_batch);
+		std::vector<ipc::VideoFrameRequest> requests;
+
+		for (int i = n; i < n + static_cast<int>(count) && i < m_vi.numFrames; ++i) {
+			requests.push_back({ m_script_result.c.clip_id, i });
+		}
+
+		std::unique_ptr<ipc_client::Command> response = runloop(std::make_unique<ipc_client::CommandGetFrames>(requests));
+
+		// The batch fails as a whole if any of its frames fails, or if they do
+		// not all fit in the heap. Retry frame (n) on its own.
+		if (requests.size() > 1 && response && response->type() == ipc_client::CommandType::ERR) {
+			ipc_log("output batch at frame %d failed, request it alone\n", n);
+			response->deallocate_heap_resources(m_client.get());
+			m_output_batch.reset();
+			requests.resize(1);
+			response = runloop(std::make_unique<ipc_client::CommandGetFrames>(requests));
+		}
+
+		response = expect_response(std::move(response), ipc_client::CommandType::SET_FRAMES);
+
+		const std::vector<ipc::VideoFrame> &frames = static_cast<ipc_client::CommandSetFrames *>(response.get())->arg();
+
+		try {
+			if (frames.size() != requests.size())
+				throw std::runtime_error{ "wrong number of frames received" };
+
+			for (size_t i = 0; i < frames.size(); ++i) {
+				if (frames[i].request.clip_id != requests[i].clip_id || frames[i].request.frame_number != requests[i].frame_number)
+					throw std::runtime_error{ "wrong frame received" };
+			}
+
+			m_output_frames.assign(frames.begin() + 1, frames.end());
+		} catch (...) {
+			response->deallocate_heap_resources(m_client.get());
+			throw;
+		}
+
+		ipc::VideoFrame ipc_frame = frames.front();
+		response->relinquish_heap_resources();
+		return ipc_frame;
+	}
 public:
 	AVSProxy(void * = nullptr) :
 		m_script_result{},
 		m_vi{},
+		m_max_output_batch{ 1 },
+		m_output_frame_size{},
 		m_active_request{},
 		m_runloop_response_received{},
-		m_remote_exit{}
+		m_remote_exit{},
+		m_first_frame_done{}
 	{}
 
+	~AVSProxy()
+	{
+		try {
+			if (m_client) {
+				clear_output_frames();
+				m_sent_frames.clear(m_client.get());
+			}
+		} catch (...) {
+			// The shared memory is released with the client.
+		}
+	}
+
 	const char *get_name(void *) noexcept override { return "Avisynth 32-bit proxy"; }
 
 	void init(const ConstMap &in, const Map &out, const Core &core) override
@@ -505,8 +759,54 @@ public:
 			slave_path = utf8_to_utf16(plugin_path.substr(0, plugin_path.find_last_of('/')) + "/avshost_native.exe");
 		}
 
-		m_client = std::make_unique<ipc_client::IPCClient>(ipc_client::IPCClient::master(), slave_path.c_str());
-		m_client->start(std::bind(&AVSProxy::recv_callback, this, std::placeholders::_1));
+		std::vector<FilterNode> clips;
+		int64_t clips_frame_size = 0;
+
+		if (in.contains("clips")) {
+			size_t num_clips = in.num_elements("clips");
+
+			if (!in.contains("clip_names") || in.num_elements("clip_names") != num_clips)
+				throw std::runtime_error{ "clips and clip_names must have same number of elements" };
+
+			for (size_t i = 0; i < num_clips; ++i) {
+				clips.push_back(in.get_prop<FilterNode>("clips", static_cast<int>(i)));
+				clips_frame_size += ipc::video_frame_size(heap_frame_layout(0, 0, clips.back().video_info()));
+			}
+		}
+
+		int64_t inflight_frames = in.contains("inflight_frames") ? in.get_prop<int64_t>("inflight_frames") : DEFAULT_INFLIGHT_FRAMES;
+		if (inflight_frames < 1 || inflight_frames > MAX_INFLIGHT_FRAMES)
+			throw std::runtime_error{ "inflight_frames out of range" };
+
+		int64_t heap_size = in.contains("heap_size") ?
+			in.get_prop<int64_t>("heap_size") :
+			std::min(ipc_client::DEFAULT_HEAP_SIZE + clips_frame_size * inflight_frames, static_cast<int64_t>(ipc_client::MAX_HEAP_SIZE));
+		if (heap_size < ipc_client::MIN_HEAP_SIZE || heap_size > ipc_client::MAX_HEAP_SIZE)
+			throw std::runtime_error{ "heap_size out of range" };
+
+		int64_t queue_size = in.contains("queue_size") ?
+			in.get_prop<int64_t>("queue_size") :
+			std::min(std::max(QUEUE_SIZE_PER_FRAME * static_cast<int64_t>(clips.size()) * inflight_frames, static_cast<int64_t>(ipc_client::DEFAULT_QUEUE_SIZE)),
+			         static_cast<int64_t>(ipc_client::MAX_QUEUE_SIZE));
+		if (queue_size < ipc_client::MIN_QUEUE_SIZE || queue_size > ipc_client::MAX_QUEUE_SIZE)
+			throw std::runtime_error{ "queue_size out of range" };
+
+		bool large_pages = !!in.get_prop<int64_t>("large_pages", map::Ignore{});
+		bool warm_up = !!in.get_prop<int64_t>("warm_up", map::Ignore{});
+		bool lock_memory = !!in.get_prop<int64_t>("lock_memory", map::Ignore{});
+		int64_t warm_up_size = warm_up ? std::min(WARM_UP_SIZE_BASE + clips_frame_size * inflight_frames, heap_size) : 0;
+
+		// Keep half of the frames budgeted for each clip to serve repeated
+		// requests.
+		m_sent_frames.set_capacity(clips.size() * std::max(inflight_frames / 2, static_cast<int64_t>(1)));
+
+		// Request output frames in batches of up to the other half.
+		m_max_output_batch = static_cast<uint32_t>(std::min(std::max(inflight_frames / 2, static_cast<int64_t>(1)), static_cast<int64_t>(ipc_client::MAX_FRAME_BATCH)));
+
+		m_init_time = std::chrono::steady_clock::now();
+		m_client = std::make_unique<ipc_client::IPCClient>(ipc_client::IPCClient::master(), slave_path.c_str(),
+			static_cast<uint32_t>(heap_size), static_cast<uint32_t>(queue_size), large_pages, static_cast<uint32_t>(warm_up_size), lock_memory);
+		m_client->start(std::bind(&AVSProxy::recv_callback, this, std::placeholders::_1), std::bind(&AVSProxy::recv_view_callback, this, std::placeholders::_1));
 
 		if (in.contains("slave_log")) {
 			std::wstring log_path = utf8_to_utf16(in.get_prop<std::string>("slave_log"));
@@ -518,25 +818,23 @@ public:
 		response = m_client->send_sync(std::make_unique<ipc_client::CommandLoadAvisynth>(avisynth_path.c_str()));
 		expect_ack(std::move(response));
 
-		if (in.contains("clips")) {
-			size_t num_clips = in.num_elements("clips");
+		// Send all the clips before waiting for the first one.
+		std::vector<ipc_client::Future<std::unique_ptr<ipc_client::Command>>> clip_responses;
+		clip_responses.reserve(clips.size());
 
-			if (!in.contains("clip_names") || in.num_elements("clip_names") != num_clips)
-				throw std::runtime_error{ "clips and clip_names must have same number of elements" };
+		for (size_t i = 0; i < clips.size(); ++i) {
+			std::string name = in.get_prop<std::string>("clip_names", static_cast<int>(i));
 
-			for (size_t i = 0; i < num_clips; ++i) {
-				FilterNode node = in.get_prop<FilterNode>("clips", static_cast<int>(i));
-				std::string name = in.get_prop<std::string>("clip_names", static_cast<int>(i));
+			ipc::Value value{ ipc::Value::CLIP };
+			value.c.clip_id = static_cast<int>(i);
+			value.c.vi = serialize_video_info(clips[i].video_info());
 
-				ipc::Value value{ ipc::Value::CLIP };
-				value.c.clip_id = static_cast<int>(i);
-				value.c.vi = serialize_video_info(node.video_info());
-
-				response = m_client->send_sync(std::make_unique<ipc_client::CommandSetScriptVar>(name, value));
-				expect_ack(std::move(response));
+			clip_responses.push_back(m_client->send_request(std::make_unique<ipc_client::CommandSetScriptVar>(name, value)));
+			m_clips[static_cast<int>(i)] = std::move(clips[i]);
+		}
 
-				m_clips[static_cast<int>(i)] = std::move(node);
-			}
+		for (std::unique_ptr<ipc_client::Command> &clip_response : ipc_client::when_all(std::move(clip_responses)).get()) {
+			expect_ack(std::move(clip_response));
 		}
 
 		uint32_t heap_script = local_to_heap_str(m_client.get(), script.c_str(), script.size());
@@ -559,6 +857,7 @@ public:
 		// Create a filter if the result was a clip.
 		case ipc::Value::CLIP: {
 			m_vi = deserialize_video_info(m_script_result.c.vi, core);
+			m_output_frame_size = static_cast<uint32_t>(ipc::video_frame_size(heap_frame_layout(0, 0, m_vi)));
 
 			FilterDependencyBuilder deps = make_deps();
 			for (const auto &entry : m_clips) {
@@ -591,22 +890,28 @@ public:
 
 	ConstFrame get_frame_initial(int n, const Core &core, const FrameContext &, void *) override
 	{
-		try {
-			std::unique_ptr<ipc_client::Command> response = runloop(
-				std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ m_script_result.c.clip_id, n }));
-			response = expect_response(std::move(response), ipc_client::CommandType::SET_FRAME);
+		auto start = std::chrono::steady_clock::now();
 
-			ipc_client::CommandSetFrame *set_frame = static_cast<ipc_client::CommandSetFrame *>(response.get());
+		try {
+			ipc::VideoFrame ipc_frame = fetch_output_frame(n);
 			ConstFrame result;
 
 			try {
-				result = heap_to_local_frame(m_client.get(), m_vi, m_script_result.c.vi.color_family, set_frame->arg(), core);
+				result = heap_to_local_frame(m_client.get(), m_vi, m_script_result.c.vi.color_family, ipc_frame, core);
 			} catch (...) {
-				response->deallocate_heap_resources(m_client.get());
+				m_client->deallocate_frame(ipc_frame);
 				throw;
 			}
 
-			response->deallocate_heap_resources(m_client.get());
+			m_client->deallocate_frame(ipc_frame);
+
+			if (!m_first_frame_done.exchange(true)) {
+				auto now = std::chrono::steady_clock::now();
+				std::chrono::duration<double, std::milli> latency = now - start;
+				std::chrono::duration<double, std::milli> since_init = now - m_init_time;
+				ipc_log("first frame %d: %.1f ms, %.1f ms after init\n", n, latency.count(), since_init.count());
+			}
+
 			return result;
 		} catch (const ipc_client::IPCError &) {
 			fatal();
@@ -622,6 +927,6 @@ public:
 
 const PluginInfo4 g_plugin_info4{
 	PLUGIN_ID, "avsw", "avsproxy", 0, {
-		{ &FilterBase::filter_create<AVSProxy>, "Eval", "script:data;clips:vnode[]:opt;clip_names:data[]:opt;avisynth:data:opt;slave:data:opt;slave_log:data:opt;", "any" }
+		{ &FilterBase::filter_create<AVSProxy>, "Eval", "script:data;clips:vnode[]:opt;clip_names:data[]:opt;avisynth:data:opt;slave:data:opt;slave_log:data:opt;heap_size:int:opt;queue_size:int:opt;inflight_frames:int:opt;large_pages:int:opt;warm_up:int:opt;lock_memory:int:opt;", "any" }
 	}
 };
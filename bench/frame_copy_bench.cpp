@@ -0,0 +1,186 @@
+// Measure frame copy throughput into and out of an IPC heap backed by regular
+// pages, transparent huge pages or hugetlbfs pages.
+//
+// Usage: frame_copy_bench [4k|thp|hugetlb] [width] [height] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include "ipc/ipc_types.h"
+#include "ipc/video_types.h"
+
+namespace {
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * (1UL << 20);
+constexpr int NUM_PLANES = 3;
+constexpr int INFLIGHT_FRAMES = 8;
+
+struct Mapping {
+	void *ptr;
+	size_t size;
+
+	Mapping(const std::string &mode, size_t size) : ptr{}, size{ (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE }
+	{
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+		if (mode == "hugetlb")
+			flags |= MAP_HUGETLB;
+		else if (mode != "4k" && mode != "thp")
+			throw std::runtime_error{ "unknown page mode" };
+
+		ptr = ::mmap(nullptr, this->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (ptr == MAP_FAILED)
+			throw std::runtime_error{ mode == "hugetlb" ? "mmap failed, check vm.nr_hugepages" : "mmap failed" };
+
+		if (mode == "thp" && ::madvise(ptr, this->size, MADV_HUGEPAGE))
+			std::fprintf(stderr, "madvise(MADV_HUGEPAGE) failed, THP may be disabled\n");
+		if (mode == "4k")
+			::madvise(ptr, this->size, MADV_NOHUGEPAGE);
+
+		// Fault in the pages outside of the timed region.
+		std::memset(ptr, 0, this->size);
+	}
+
+	~Mapping() { ::munmap(ptr, size); }
+
+	Mapping(const Mapping &) = delete;
+	Mapping &operator=(const Mapping &) = delete;
+};
+
+// Same semantics as vsh::bitblt.
+void bitblt(void *dst, ptrdiff_t dst_stride, const void *src, ptrdiff_t src_stride, size_t row_size, size_t height)
+{
+	if (src_stride == dst_stride && src_stride == static_cast<ptrdiff_t>(row_size)) {
+		std::memcpy(dst, src, row_size * height);
+		return;
+	}
+
+	for (size_t i = 0; i < height; ++i) {
+		std::memcpy(dst, src, row_size);
+		dst = static_cast<unsigned char *>(dst) + dst_stride;
+		src = static_cast<const unsigned char *>(src) + src_stride;
+	}
+}
+
+struct LocalFrame {
+	std::vector<unsigned char> data[NUM_PLANES];
+	ptrdiff_t stride;
+	int width;
+	int height;
+
+	LocalFrame(int width, int height) : stride{ (width + 31) / 32 * 32 + 32 }, width{ width }, height{ height }
+	{
+		for (auto &plane : data) {
+			plane.resize(stride * height, 0x80);
+		}
+	}
+};
+
+// YV24 layout with 64-byte aligned rows, as in local_to_heap_frame.
+ipc::VideoFrame frame_layout(int width, int height)
+{
+	ipc::VideoFrame frame{};
+
+	for (int p = 0; p < NUM_PLANES; ++p) {
+		frame.stride[p] = width % 64 ? width + 64 - width % 64 : width;
+		frame.height[p] = height;
+	}
+	return frame;
+}
+
+double run(const std::string &mode, uint32_t alignment, int width, int height, int iterations)
+{
+	ipc::VideoFrame layout = frame_layout(width, height);
+	size_t heap_size = sizeof(ipc::Heap) + (ipc::video_frame_size(layout) + alignment + sizeof(ipc::HeapNode)) * INFLIGHT_FRAMES * 2;
+	if (heap_size > UINT32_MAX / 2)
+		throw std::runtime_error{ "frame too large" };
+
+	Mapping mapping{ mode, heap_size };
+
+	ipc::Heap *heap = new (mapping.ptr) ipc::Heap{};
+	heap->size = static_cast<uint32_t>(mapping.size);
+	heap->committed_size = heap->size;
+	ipc::heap_init(heap);
+
+	// Offset the blocks from the start of the heap as they would be in the
+	// shared memory.
+	ipc::HeapNode *offset_block = ipc::heap_alloc(heap, 1000);
+
+	std::vector<ipc::HeapNode *> blocks;
+	for (int i = 0; i < INFLIGHT_FRAMES; ++i) {
+		ipc::HeapNode *node = ipc::heap_alloc_aligned(heap, static_cast<uint32_t>(ipc::video_frame_size(layout)), alignment);
+		if (!node)
+			throw std::runtime_error{ "heap full" };
+		blocks.push_back(node);
+	}
+
+	LocalFrame src{ width, height };
+	LocalFrame dst{ width, height };
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < iterations; ++i) {
+		unsigned char *heap_ptr = reinterpret_cast<unsigned char *>(blocks[i % INFLIGHT_FRAMES] + 1);
+		unsigned char *ptr = heap_ptr;
+
+		for (int p = 0; p < NUM_PLANES; ++p) {
+			bitblt(ptr, layout.stride[p], src.data[p].data(), src.stride, width, height);
+			ptr += layout.stride[p] * layout.height[p];
+		}
+
+		ptr = heap_ptr;
+		for (int p = 0; p < NUM_PLANES; ++p) {
+			bitblt(dst.data[p].data(), dst.stride, ptr, layout.stride[p], width, height);
+			ptr += layout.stride[p] * layout.height[p];
+		}
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for (ipc::HeapNode *node : blocks) {
+		ipc::heap_free(heap, node);
+	}
+	ipc::heap_free(heap, offset_block);
+
+	// Bytes copied in and out.
+	double bytes = 2.0 * NUM_PLANES * width * height * iterations;
+	return bytes / elapsed.count() / 1e9;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	std::string mode = argc > 1 ? argv[1] : "4k";
+	int width = argc > 2 ? std::atoi(argv[2]) : 3840;
+	int height = argc > 3 ? std::atoi(argv[3]) : 2160;
+	int iterations = argc > 4 ? std::atoi(argv[4]) : 200;
+
+	if (width <= 0 || height <= 0 || iterations <= 0) {
+		std::fprintf(stderr, "usage: %s [4k|thp|hugetlb] [width] [height] [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	try {
+		std::printf("%s pages, %dx%d YV24, %d frames\n", mode.c_str(), width, height, iterations);
+
+		for (uint32_t alignment : { static_cast<uint32_t>(alignof(ipc::HeapNode)), 4096U }) {
+			double throughput = run(mode, alignment, width, height, iterations);
+			std::printf("payload alignment %5u: %.2f GB/s\n", alignment, throughput);
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,323 @@
+// Replay allocation traces against each heap allocation policy.
+//
+// Usage: heap_bench [heap_size_mb] [trace_file...]
+//
+// Without trace files, synthetic traces are generated. A trace file contains
+// one operation per line:
+//   a <id> <size>   allocate a block
+//   f <id>          free a block by its owner
+//   r <id>          free a block by the remote process
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include "ipc/ipc_types.h"
+
+namespace {
+
+struct Op {
+	enum Type { ALLOC, FREE, FREE_REMOTE };
+
+	Type type;
+	uint32_t id;
+	uint32_t size;
+};
+
+struct Trace {
+	std::string name;
+	std::vector<Op> ops;
+	uint32_t num_ids = 0;
+
+	uint32_t alloc(uint32_t size)
+	{
+		ops.push_back({ Op::ALLOC, num_ids, size });
+		return num_ids++;
+	}
+
+	void free(uint32_t id, bool remote = false) { ops.push_back({ remote ? Op::FREE_REMOTE : Op::FREE, id, 0 }); }
+};
+
+struct Result {
+	double ns_per_op;
+	double avg_nodes_scanned;
+	uint32_t max_nodes_scanned;
+	double peak_fragmentation;
+	uint64_t allocs;
+	uint64_t failures;
+};
+
+// Frame sizes with 64-byte aligned rows: 480p and 1080p YV12, UHD YV12 and
+// UHD YV24 at 16 bits.
+constexpr uint32_t FRAME_SIZES[] = {
+	(704 * 480) * 3 / 2,
+	(1920 * 1080) * 3 / 2,
+	(3840 * 2160) * 3 / 2,
+	(3840 * 2 * 2160) * 3,
+};
+
+uint32_t random_string_size(std::mt19937 &rng)
+{
+	// Mostly short names and scripts, occasionally a large script.
+	return rng() % 16 ? 16 + rng() % 256 : 4096 + rng() % 65536;
+}
+
+// Frames of several formats in flight, interleaved with short-lived strings.
+Trace mixed_trace(uint32_t num_ops)
+{
+	Trace trace{ "mixed" };
+	std::mt19937 rng{ 1 };
+	std::deque<uint32_t> frames;
+	std::vector<uint32_t> strings;
+
+	while (trace.ops.size() < num_ops) {
+		uint32_t format = (static_cast<uint32_t>(trace.ops.size()) / 20000) % (sizeof(FRAME_SIZES) / sizeof(FRAME_SIZES[0]));
+
+		frames.push_back(trace.alloc(FRAME_SIZES[format]));
+		if (frames.size() > 6) {
+			trace.free(frames.front());
+			frames.pop_front();
+		}
+
+		for (uint32_t i = rng() % 8; i; --i) {
+			strings.push_back(trace.alloc(random_string_size(rng)));
+		}
+		while (strings.size() > 32) {
+			size_t idx = rng() % strings.size();
+			trace.free(strings[idx]);
+			strings[idx] = strings.back();
+			strings.pop_back();
+		}
+	}
+	return trace;
+}
+
+// Blocks sent to the other side and freed there out of order, while the owner
+// frees its own temporaries.
+Trace two_sided_trace(uint32_t num_ops)
+{
+	Trace trace{ "two-sided" };
+	std::mt19937 rng{ 2 };
+	std::vector<uint32_t> sent;
+	std::vector<uint32_t> local;
+
+	while (trace.ops.size() < num_ops) {
+		if (rng() % 2)
+			sent.push_back(trace.alloc(rng() % 4 ? random_string_size(rng) : FRAME_SIZES[1 + rng() % 2]));
+		else
+			local.push_back(trace.alloc(random_string_size(rng)));
+
+		if (sent.size() > 24) {
+			size_t idx = rng() % sent.size();
+			trace.free(sent[idx], true);
+			sent[idx] = sent.back();
+			sent.pop_back();
+		}
+		if (local.size() > 16) {
+			size_t idx = rng() % local.size();
+			trace.free(local[idx]);
+			local[idx] = local.back();
+			local.pop_back();
+		}
+	}
+	return trace;
+}
+
+// Long run with a stable live set of random sizes.
+Trace steady_trace(uint32_t num_ops)
+{
+	Trace trace{ "steady" };
+	std::mt19937 rng{ 3 };
+	std::vector<uint32_t> live;
+
+	while (trace.ops.size() < num_ops) {
+		if (live.size() < 256 || rng() % 2) {
+			uint32_t size = rng() % 8 ? random_string_size(rng) : FRAME_SIZES[rng() % 3];
+			live.push_back(trace.alloc(size));
+		} else {
+			size_t idx = rng() % live.size();
+			trace.free(live[idx]);
+			live[idx] = live.back();
+			live.pop_back();
+		}
+	}
+	return trace;
+}
+
+Trace load_trace(const char *path)
+{
+	std::ifstream file{ path };
+	if (!file)
+		throw std::runtime_error{ std::string{ "could not open " } + path };
+
+	Trace trace{ path };
+	std::string type;
+	uint32_t id;
+
+	while (file >> type >> id) {
+		Op op{ Op::ALLOC, id, 0 };
+
+		if (type == "a" && file >> op.size)
+			op.type = Op::ALLOC;
+		else if (type == "f")
+			op.type = Op::FREE;
+		else if (type == "r")
+			op.type = Op::FREE_REMOTE;
+		else
+			throw std::runtime_error{ std::string{ "bad trace line in " } + path };
+
+		trace.ops.push_back(op);
+		trace.num_ids = std::max(trace.num_ids, id + 1);
+	}
+	return trace;
+}
+
+class HeapBuffer {
+	void *m_ptr;
+	uint32_t m_size;
+public:
+	explicit HeapBuffer(uint32_t size) : m_ptr{ ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) }, m_size{ size }
+	{
+		if (m_ptr == MAP_FAILED)
+			throw std::bad_alloc{};
+		// Fault in the pages outside of the timed region.
+		std::memset(m_ptr, 0, size);
+	}
+
+	~HeapBuffer() { ::munmap(m_ptr, m_size); }
+
+	HeapBuffer(const HeapBuffer &) = delete;
+	HeapBuffer &operator=(const HeapBuffer &) = delete;
+
+	template <class Policy>
+	ipc::Heap *init()
+	{
+		ipc::Heap *heap = new (m_ptr) ipc::Heap{};
+		heap->size = m_size;
+		heap->committed_size = m_size;
+		ipc::heap_init<Policy>(heap);
+		return heap;
+	}
+};
+
+// Replay the trace. Blocks whose allocation failed are skipped when freed.
+// Remote frees are drained before each allocation, as IPCClient does.
+template <class Policy>
+void replay(ipc::Heap *heap, const Trace &trace, double *peak_fragmentation)
+{
+	std::vector<ipc::HeapNode *> blocks(trace.num_ids);
+
+	for (const Op &op : trace.ops) {
+		switch (op.type) {
+		case Op::ALLOC:
+			ipc::heap_drain_remote<Policy>(heap);
+			blocks[op.id] = ipc::heap_alloc<Policy>(heap, op.size);
+			break;
+		case Op::FREE:
+			if (blocks[op.id])
+				ipc::heap_free<Policy>(heap, blocks[op.id]);
+			blocks[op.id] = nullptr;
+			break;
+		case Op::FREE_REMOTE:
+			if (blocks[op.id])
+				ipc::heap_free_remote(heap, blocks[op.id]);
+			blocks[op.id] = nullptr;
+			break;
+		}
+
+		if (peak_fragmentation) {
+			ipc::heap_update_stats<Policy>(heap);
+			*peak_fragmentation = std::max(*peak_fragmentation, ipc::heap_stats(heap).fragmentation);
+		}
+	}
+}
+
+template <class Policy>
+Result run(HeapBuffer &buffer, const Trace &trace)
+{
+	Result result{};
+
+	// Timed pass.
+	ipc::Heap *heap = buffer.init<Policy>();
+	auto start = std::chrono::steady_clock::now();
+	replay<Policy>(heap, trace, nullptr);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	ipc::heap_update_stats<Policy>(heap);
+	ipc::HeapStats stats = ipc::heap_stats(heap);
+	result.ns_per_op = elapsed.count() / trace.ops.size();
+	result.avg_nodes_scanned = stats.avg_nodes_scanned;
+	result.max_nodes_scanned = stats.max_nodes_scanned;
+	result.allocs = stats.alloc_count + stats.alloc_failures;
+	result.failures = stats.alloc_failures;
+
+	// Sampling the fragmentation after every operation would distort the
+	// timing, so it is done in a separate pass.
+	heap = buffer.init<Policy>();
+	replay<Policy>(heap, trace, &result.peak_fragmentation);
+
+	return result;
+}
+
+template <class Policy>
+void report(const char *policy_name, HeapBuffer &buffer, const Trace &trace)
+{
+	Result result = run<Policy>(buffer, trace);
+
+	std::printf("%-12s %-16s %10zu %8.1f %9.2f %9u %9.1f%% %8.3f%%\n",
+		trace.name.c_str(), policy_name, trace.ops.size(), result.ns_per_op,
+		result.avg_nodes_scanned, result.max_nodes_scanned, result.peak_fragmentation * 100.0,
+		result.allocs ? 100.0 * result.failures / result.allocs : 0.0);
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	try {
+		uint32_t heap_size_mb = argc > 1 ? std::atoi(argv[1]) : 512;
+		if (heap_size_mb < 1 || heap_size_mb > 2048) {
+			std::fprintf(stderr, "usage: %s [heap_size_mb] [trace_file...]\n", argv[0]);
+			return 1;
+		}
+
+		std::vector<Trace> traces;
+		if (argc > 2) {
+			for (int i = 2; i < argc; ++i) {
+				traces.push_back(load_trace(argv[i]));
+			}
+		} else {
+			traces.push_back(mixed_trace(200000));
+			traces.push_back(two_sided_trace(200000));
+			traces.push_back(steady_trace(2000000));
+		}
+
+		HeapBuffer buffer{ heap_size_mb * (1U << 20) };
+
+		std::printf("%u MB heap\n", heap_size_mb);
+		std::printf("%-12s %-16s %10s %8s %9s %9s %10s %9s\n",
+			"trace", "policy", "ops", "ns/op", "avg scan", "max scan", "peak frag", "failures");
+
+		for (const Trace &trace : traces) {
+			report<ipc::FirstFitPolicy>("first-fit", buffer, trace);
+			report<ipc::SegregatedFitPolicy>("segregated-fit", buffer, trace);
+			report<ipc::BestFitPolicy>("best-fit", buffer, trace);
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
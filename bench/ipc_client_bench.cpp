@@ -0,0 +1,203 @@
+// Measure command latency and throughput of IPCClient between two processes,
+// using the POSIX platform layer. The benchmark starts a copy of itself as the
+// slave, which answers every GET_FRAME with an ACK.
+//
+// Usage: ipc_client_bench [round_trips] [queue_size]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ipc/ipc_client.h"
+#include "ipc/ipc_commands.h"
+#include "ipc/ipc_types.h"
+#include "ipc/logging.h"
+#include "ipc/video_types.h"
+
+namespace {
+
+constexpr uint32_t HEAP_SIZE = 1UL << 20;
+constexpr uint32_t INFLIGHT_REQUESTS = 64;
+
+const char *priority_name(ipc_client::Priority priority)
+{
+	return priority == ipc_client::Priority::URGENT ? "urgent" : "regular";
+}
+
+// Answer requests in place on the receiver thread.
+int run_slave(int master_pid, int shmem_fd, size_t shmem_size)
+{
+	ipc_client::IPCClient client{ ipc_client::IPCClient::slave(), master_pid, shmem_fd, shmem_size };
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done = false;
+
+	// Neither the request nor the response is allocated.
+	auto view_cb = [&](const ipc_client::CommandView &view)
+	{
+		ipc_client::FrameRequests requests;
+		if (!ipc_client::read_frame_requests(view, &requests))
+			return false;
+
+		ipc_client::CommandAck response;
+		response.set_response_id(requests.transaction_id);
+		client.send_async(response, nullptr, ipc_client::Priority::URGENT);
+		return true;
+	};
+
+	// Called with null when the master goes away.
+	auto default_cb = [&](std::unique_ptr<ipc_client::Command> c)
+	{
+		if (c) {
+			c->deallocate_heap_resources(&client);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock{ mutex };
+		done = true;
+		cond.notify_all();
+	};
+
+	client.start(default_cb, view_cb);
+
+	std::unique_lock<std::mutex> lock{ mutex };
+	cond.wait(lock, [&]() { return done; });
+	return 0;
+}
+
+struct Result {
+	double mean_us;
+	double p50_us;
+	double p99_us;
+};
+
+Result round_trips(ipc_client::IPCClient &client, ipc_client::Priority priority, uint32_t count)
+{
+	std::vector<double> latencies(count);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		auto response = client.send_sync(std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ 0, static_cast<int32_t>(i) }), priority);
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+		if (!response || response->type() != ipc_client::CommandType::ACK)
+			throw std::runtime_error{ "unexpected response" };
+		latencies[i] = elapsed.count();
+	}
+
+	Result result{};
+	for (double x : latencies) {
+		result.mean_us += x;
+	}
+	result.mean_us /= count;
+
+	std::sort(latencies.begin(), latencies.end());
+	result.p50_us = latencies[count / 2];
+	result.p99_us = latencies[static_cast<size_t>(count * 0.99)];
+	return result;
+}
+
+// Requests per second with up to INFLIGHT_REQUESTS outstanding.
+double throughput(ipc_client::IPCClient &client, ipc_client::Priority priority, uint32_t count)
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	uint32_t inflight = 0;
+	uint32_t completed = 0;
+	bool failed = false;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < count; ++i) {
+		{
+			std::unique_lock<std::mutex> lock{ mutex };
+			cond.wait(lock, [&]() { return inflight < INFLIGHT_REQUESTS; });
+			++inflight;
+		}
+
+		client.send_async(std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ 0, static_cast<int32_t>(i) }),
+			[&](std::unique_ptr<ipc_client::Command> c)
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			failed = failed || !c || c->type() != ipc_client::CommandType::ACK;
+			--inflight;
+			++completed;
+			cond.notify_all();
+		}, priority);
+	}
+
+	std::unique_lock<std::mutex> lock{ mutex };
+	cond.wait(lock, [&]() { return completed == count; });
+
+	if (failed)
+		throw std::runtime_error{ "unexpected response" };
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return count / elapsed.count();
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	// Started as the slave with the master pid, shared memory fd and size.
+	if (argc == 4) {
+		try {
+			return run_slave(std::atoi(argv[1]), std::atoi(argv[2]), std::strtoul(argv[3], nullptr, 10));
+		} catch (const std::exception &e) {
+			std::fprintf(stderr, "slave: %s\n", e.what());
+			return 1;
+		}
+	}
+
+	int count = argc > 1 ? std::atoi(argv[1]) : 100000;
+	int queue_size = argc > 2 ? std::atoi(argv[2]) : ipc_client::DEFAULT_QUEUE_SIZE;
+	if (argc > 3 || count <= 0 || queue_size <= 0) {
+		std::fprintf(stderr, "usage: %s [round_trips] [queue_size]\n", argv[0]);
+		return 1;
+	}
+
+	if (std::getenv("IPC_LOG"))
+		ipc_set_log_handler(ipc_log_stderr, ipc_wlog_stderr);
+
+	try {
+		ipc_client::IPCClient client{ ipc_client::IPCClient::master(), "/proc/self/exe", HEAP_SIZE, static_cast<uint32_t>(queue_size) };
+		client.start([&](std::unique_ptr<ipc_client::Command> c)
+		{
+			if (c)
+				c->deallocate_heap_resources(&client);
+		});
+
+		std::printf("%d round trips, %d byte queue\n", count, queue_size);
+		std::printf("%-8s %9s %9s %9s %12s\n", "lane", "mean us", "p50 us", "p99 us", "requests/s");
+
+		for (ipc_client::Priority priority : { ipc_client::Priority::NORMAL, ipc_client::Priority::URGENT }) {
+			Result result = round_trips(client, priority, count);
+			double rate = throughput(client, priority, count);
+			std::printf("%-8s %9.2f %9.2f %9.2f %12.0f\n", priority_name(priority), result.mean_us, result.p50_us, result.p99_us, rate);
+		}
+
+		for (ipc_client::Priority priority : { ipc_client::Priority::NORMAL, ipc_client::Priority::URGENT }) {
+			ipc_client::IPCClient::QueueStats stats = client.send_queue_stats(priority);
+			std::printf("%s send queue: %llu stalls, %llu us\n", priority_name(priority),
+				static_cast<unsigned long long>(stats.stalls), static_cast<unsigned long long>(stats.stall_time_us));
+		}
+
+		client.stop();
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
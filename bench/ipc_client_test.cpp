@@ -0,0 +1,253 @@
+// Checks of IPCClient sessions, using the POSIX platform layer. The
+// test starts a copy of itself as the slave, which answers most commands with
+// an ACK.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "ipc/ipc_client.h"
+#include "ipc/ipc_commands.h"
+#include "ipc/ipc_types.h"
+#include "ipc/video_types.h"
+
+namespace {
+
+constexpr uint32_t HEAP_SIZE = 1UL << 20;
+constexpr uint32_t TIMEOUT = 5000;
+
+// Requests for this clip are answered with a frame allocated by the slave.
+constexpr uint32_t FRAME_CLIP = 1;
+
+int failures = 0;
+
+void check(bool condition, const char *what)
+{
+	std::printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+	failures += !condition;
+}
+
+int run_slave(int master_pid, int shmem_fd, size_t shmem_size)
+{
+	ipc_client::IPCClient client{ ipc_client::IPCClient::slave(), master_pid, shmem_fd, shmem_size };
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done = false;
+
+	client.start([&](std::unique_ptr<ipc_client::Command> c)
+	{
+		// Exit without notice when asked for a new script environment.
+		if (c && c->type() == ipc_client::CommandType::NEW_SCRIPT_ENV)
+			std::_Exit(0);
+
+		// Frame batches that were not decoded in place are rejected.
+		if (c && c->type() == ipc_client::CommandType::GET_FRAMES) {
+			ipc_client::CommandErr response;
+			response.set_response_id(c->transaction_id());
+			client.send_async(response);
+			return;
+		}
+
+		if (c) {
+			ipc_client::CommandAck response;
+			response.set_response_id(c->transaction_id());
+			client.send_async(response);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock{ mutex };
+		done = true;
+		cond.notify_all();
+	}, [&](const ipc_client::CommandView &view)
+	{
+		// Frame requests are decoded in place. They must be numbered from zero.
+		ipc_client::FrameRequests requests;
+		if (!ipc_client::read_frame_requests(view, &requests))
+			return false;
+
+		if (requests.requests[0].clip_id == FRAME_CLIP) {
+			ipc::VideoFrame frame{ requests.requests[0] };
+			frame.stride[0] = 4096;
+			frame.height[0] = 16;
+			client.allocate_frame(&frame);
+
+			// Report the frame pool hits so far through the frame number.
+			frame.request.frame_number = static_cast<int32_t>(client.frame_pool_stats().hits);
+
+			ipc_client::CommandSetFrame response{ frame };
+			response.set_response_id(view.transaction_id());
+			client.send_async(response);
+			return true;
+		}
+
+		bool valid = requests.transaction_id == view.transaction_id();
+		for (uint32_t i = 0; i < requests.count; ++i) {
+			valid = valid && requests.requests[i].frame_number == static_cast<int32_t>(i);
+		}
+
+		if (valid) {
+			ipc_client::CommandAck response;
+			response.set_response_id(view.transaction_id());
+			client.send_async(response);
+		} else {
+			ipc_client::CommandErr response;
+			response.set_response_id(view.transaction_id());
+			client.send_async(response);
+		}
+		return true;
+	});
+
+	std::unique_lock<std::mutex> lock{ mutex };
+	cond.wait(lock, [&]() { return done; });
+	return 0;
+}
+
+std::unique_ptr<ipc_client::Command> make_request()
+{
+	return std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ 0, 0 });
+}
+
+void check_stop()
+{
+	ipc_client::IPCClient client{ ipc_client::IPCClient::master(), "/proc/self/exe", HEAP_SIZE };
+	client.start([&](std::unique_ptr<ipc_client::Command> c)
+	{
+		if (c)
+			c->deallocate_heap_resources(&client);
+	});
+
+	auto response = client.send_request(make_request());
+	check(response.wait_for(TIMEOUT), "request completes");
+	std::unique_ptr<ipc_client::Command> c = response.get();
+	check(c && c->type() == ipc_client::CommandType::ACK, "request is acknowledged");
+
+	std::vector<ipc::VideoFrameRequest> batch{ { 0, 0 }, { 0, 1 }, { 0, 2 } };
+	c = client.send_sync(std::make_unique<ipc_client::CommandGetFrames>(batch));
+	check(c && c->type() == ipc_client::CommandType::ACK, "frame requests are decoded in place");
+
+	c = client.send_sync(std::make_unique<ipc_client::CommandGetFrames>(std::vector<ipc::VideoFrameRequest>{}));
+	check(c && c->type() == ipc_client::CommandType::ERR, "empty frame batch is not decoded in place");
+
+	// Pending requests are failed when the session is stopped.
+	std::vector<ipc_client::Future<std::unique_ptr<ipc_client::Command>>> requests;
+	requests.push_back(client.send_request(make_request()));
+
+	client.stop();
+
+	requests.push_back(client.send_request(make_request()));
+	check(requests.back().wait_for(TIMEOUT), "request after stop completes");
+
+	auto all = ipc_client::when_all(std::move(requests));
+	check(all.wait_for(TIMEOUT), "when_all over a stopped session completes");
+	check(!all.get().back(), "request after stop has a null result");
+
+	check(!client.send_sync(make_request()), "send_sync after stop returns null");
+}
+
+// Frames freed by the master return to the pool of the slave that allocated
+// them.
+void check_frame_recycling()
+{
+	ipc_client::IPCClient client{ ipc_client::IPCClient::master(), "/proc/self/exe", HEAP_SIZE };
+	client.start([&](std::unique_ptr<ipc_client::Command> c)
+	{
+		if (c)
+			c->deallocate_heap_resources(&client);
+	});
+
+	int32_t hits[2] = { -1, -1 };
+
+	for (int32_t &slave_hits : hits) {
+		std::unique_ptr<ipc_client::Command> c = client.send_sync(std::make_unique<ipc_client::CommandGetFrame>(ipc::VideoFrameRequest{ FRAME_CLIP, 0 }));
+		if (!c || c->type() != ipc_client::CommandType::SET_FRAME)
+			break;
+
+		slave_hits = static_cast<ipc_client::CommandSetFrame *>(c.get())->arg().request.frame_number;
+		c->deallocate_heap_resources(&client);
+	}
+
+	check(hits[0] == 0, "first frame misses the slave frame pool");
+	check(hits[1] == 1, "frame freed by the master is recycled by the slave");
+}
+
+// A caller that sends while holding a lock that its callback takes, as
+// AVSProxy::runloop does, must release it around the send once the slave has
+// died.
+void check_slave_exit()
+{
+	ipc_client::IPCClient client{ ipc_client::IPCClient::master(), "/proc/self/exe", HEAP_SIZE };
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool remote_exit = false;
+	bool received = false;
+
+	client.start([&](std::unique_ptr<ipc_client::Command> c)
+	{
+		if (c) {
+			c->deallocate_heap_resources(&client);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock{ mutex };
+		remote_exit = true;
+		cond.notify_all();
+	});
+
+	client.send_async(std::make_unique<ipc_client::CommandNewScriptEnv>());
+
+	std::unique_lock<std::mutex> lock{ mutex };
+	check(cond.wait_for(lock, std::chrono::milliseconds{ TIMEOUT }, [&]() { return remote_exit; }), "slave exit is detected");
+
+	auto callback = [&](std::unique_ptr<ipc_client::Command> c)
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		received = !c;
+		cond.notify_all();
+	};
+
+	// The first send raises the error that ended the session.
+	lock.unlock();
+	try {
+		client.send_async(make_request(), callback);
+		check(false, "send after slave exit raises the session error");
+	} catch (const ipc_client::IPCError &) {
+		check(true, "send after slave exit raises the session error");
+	}
+	client.send_async(make_request(), callback);
+	lock.lock();
+
+	check(cond.wait_for(lock, std::chrono::milliseconds{ TIMEOUT }, [&]() { return received; }), "request after slave exit fails");
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	if (argc == 4) {
+		try {
+			return run_slave(std::atoi(argv[1]), std::atoi(argv[2]), std::strtoul(argv[3], nullptr, 10));
+		} catch (const std::exception &e) {
+			std::fprintf(stderr, "slave: %s\n", e.what());
+			return 1;
+		}
+	}
+
+	try {
+		check_stop();
+		check_frame_recycling();
+		check_slave_exit();
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return failures ? 1 : 0;
+}
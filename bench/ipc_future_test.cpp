@@ -0,0 +1,105 @@
+// Checks of awaiting ipc_client::Future from a C++20 coroutine. Built as
+// C++20, unlike the rest of the tree.
+
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ipc/ipc_future.h"
+
+#ifndef IPC_COROUTINES
+  #error coroutines not supported
+#endif
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what)
+{
+	std::printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+	failures += !condition;
+}
+
+// Coroutine that starts immediately and is never awaited.
+struct Task {
+	struct promise_type {
+		Task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+typedef ipc_client::Future<int>::state_type State;
+
+Task await_value(ipc_client::Future<int> future, std::thread::id *resumed_on, int *result)
+{
+	*result = co_await future;
+	*resumed_on = std::this_thread::get_id();
+}
+
+Task await_all(std::vector<ipc_client::Future<int>> futures, int *sum)
+{
+	for (int value : co_await ipc_client::when_all(std::move(futures))) {
+		*sum += value;
+	}
+}
+
+} // namespace
+
+
+int main()
+{
+	// A future completed by another thread resumes the coroutine there.
+	{
+		auto state = std::make_shared<State>();
+		std::thread::id resumed_on;
+		int result = 0;
+
+		await_value(ipc_client::Future<int>{ state }, &resumed_on, &result);
+		check(result == 0, "coroutine suspends on a pending future");
+
+		std::thread::id completed_on;
+		std::thread thread{ [&]() { completed_on = std::this_thread::get_id(); state->set_value(42); } };
+		thread.join();
+
+		check(result == 42, "coroutine receives the value");
+		check(resumed_on == completed_on, "coroutine resumes on the completing thread");
+	}
+
+	// A ready future does not suspend.
+	{
+		auto state = std::make_shared<State>();
+		state->set_value(7);
+
+		std::thread::id resumed_on;
+		int result = 0;
+
+		await_value(ipc_client::Future<int>{ state }, &resumed_on, &result);
+		check(result == 7 && resumed_on == std::this_thread::get_id(), "ready future completes without suspending");
+	}
+
+	// when_all can be awaited.
+	{
+		auto a = std::make_shared<State>();
+		auto b = std::make_shared<State>();
+		int sum = 0;
+
+		std::vector<ipc_client::Future<int>> futures;
+		futures.emplace_back(a);
+		futures.emplace_back(b);
+		await_all(std::move(futures), &sum);
+
+		a->set_value(1);
+		check(sum == 0, "when_all waits for every future");
+		b->set_value(2);
+		check(sum == 3, "when_all resumes with every value");
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+// Measure command round-trip latency between two processes over a pair of IPC
+// queues, with and without receiver polling and signal suppression.
+//
+// Usage: ping_pong_bench [round_trips] [spin_us...]
+//
+// The receiver and sender follow the protocol of IPCClient, with a futex in
+// place of the Win32 auto-reset events.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ipc/ipc_types.h"
+#include "ipc/video_types.h"
+
+namespace {
+
+constexpr uint32_t QUEUE_SIZE = 4096;
+
+// Same size as an ACK or GET_FRAME command.
+constexpr uint32_t COMMAND_SIZE = sizeof(ipc::Command) + sizeof(ipc::VideoFrameRequest);
+
+void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Auto-reset event shared between processes.
+struct alignas(64) Event {
+	std::atomic_uint32_t signaled{ 0 };
+	std::atomic<uint64_t> set_count{ 0 };
+};
+
+void set_event(Event *event)
+{
+	event->set_count.fetch_add(1, std::memory_order_relaxed);
+	event->signaled.store(1, std::memory_order_release);
+	::syscall(SYS_futex, &event->signaled, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+void wait_event(Event *event)
+{
+	while (!event->signaled.exchange(0, std::memory_order_acquire)) {
+		::syscall(SYS_futex, &event->signaled, FUTEX_WAIT, 0, nullptr, nullptr, 0);
+	}
+}
+
+struct Channel {
+	ipc::Queue *queue;
+	Event *event;
+};
+
+struct SharedState {
+	Event ping_event;
+	Event pong_event;
+	alignas(64) unsigned char ping_queue[QUEUE_SIZE];
+	alignas(64) unsigned char pong_queue[QUEUE_SIZE];
+};
+
+struct Mode {
+	const char *name;
+	uint32_t spin_us;
+	bool always_signal;
+};
+
+// Same as IPCClient::wait_recv_commands.
+void wait_commands(const Channel &channel, const Mode &mode)
+{
+	ipc::Queue *queue = channel.queue;
+
+	if (!mode.always_signal && mode.spin_us) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds{ mode.spin_us };
+
+		for (unsigned i = 1; ; ++i) {
+			if (ipc::queue_readable(queue))
+				return;
+			if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline)
+				break;
+			cpu_relax();
+		}
+	}
+
+	queue->reader_waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	while (!ipc::queue_readable(queue)) {
+		wait_event(channel.event);
+	}
+
+	queue->reader_waiting.store(0, std::memory_order_relaxed);
+}
+
+// Same as IPCClient::send_async.
+void send(const Channel &channel, const Mode &mode, const void *buf)
+{
+	ipc::queue_write(channel.queue, buf, COMMAND_SIZE);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mode.always_signal || channel.queue->reader_waiting.load(std::memory_order_relaxed))
+		set_event(channel.event);
+}
+
+void recv(const Channel &channel, const Mode &mode, void *buf)
+{
+	wait_commands(channel, mode);
+
+	uint32_t size = ipc::queue_readable(channel.queue);
+	if (size != COMMAND_SIZE)
+		throw std::runtime_error{ "unexpected command size" };
+
+	ipc::queue_read(channel.queue, buf, size);
+}
+
+ipc::Queue *init_queue(unsigned char *mem)
+{
+	ipc::Queue *queue = new (mem) ipc::Queue{};
+	queue->size = QUEUE_SIZE;
+	return queue;
+}
+
+struct Result {
+	double mean_us;
+	double p50_us;
+	double p99_us;
+	double signals_per_trip;
+};
+
+Result run(SharedState *state, const Mode &mode, uint32_t round_trips)
+{
+	new (&state->ping_event) Event{};
+	new (&state->pong_event) Event{};
+
+	Channel ping{ init_queue(state->ping_queue), &state->ping_event };
+	Channel pong{ init_queue(state->pong_queue), &state->pong_event };
+
+	pid_t pid = ::fork();
+	if (pid < 0)
+		throw std::runtime_error{ "fork failed" };
+
+	unsigned char buf[COMMAND_SIZE] = {};
+
+	// The child echoes every command back.
+	if (pid == 0) {
+		try {
+			for (uint32_t i = 0; i < round_trips; ++i) {
+				recv(ping, mode, buf);
+				send(pong, mode, buf);
+			}
+		} catch (...) {
+			::_exit(1);
+		}
+		::_exit(0);
+	}
+
+	std::vector<double> latencies(round_trips);
+
+	for (uint32_t i = 0; i < round_trips; ++i) {
+		std::memcpy(buf, &i, sizeof(i));
+
+		auto start = std::chrono::steady_clock::now();
+		send(ping, mode, buf);
+		recv(pong, mode, buf);
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+		uint32_t echoed;
+		std::memcpy(&echoed, buf, sizeof(echoed));
+		if (echoed != i)
+			throw std::runtime_error{ "wrong command echoed" };
+
+		latencies[i] = elapsed.count();
+	}
+
+	int status;
+	if (::waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		throw std::runtime_error{ "child failed" };
+
+	Result result{};
+	for (double x : latencies) {
+		result.mean_us += x;
+	}
+	result.mean_us /= round_trips;
+
+	std::sort(latencies.begin(), latencies.end());
+	result.p50_us = latencies[round_trips / 2];
+	result.p99_us = latencies[static_cast<size_t>(round_trips * 0.99)];
+
+	uint64_t signals = state->ping_event.set_count.load() + state->pong_event.set_count.load();
+	result.signals_per_trip = static_cast<double>(signals) / round_trips;
+	return result;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	int round_trips = argc > 1 ? std::atoi(argv[1]) : 100000;
+	if (round_trips <= 0) {
+		std::fprintf(stderr, "usage: %s [round_trips] [spin_us...]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Mode> modes{ { "always signal", 0, true } };
+	if (argc > 2) {
+		for (int i = 2; i < argc; ++i) {
+			modes.push_back({ "suppress", static_cast<uint32_t>(std::atoi(argv[i])), false });
+		}
+	} else {
+		for (uint32_t spin_us : { 0, 10, 50, 200 }) {
+			modes.push_back({ "suppress", spin_us, false });
+		}
+	}
+
+	void *mem = ::mmap(nullptr, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		std::fprintf(stderr, "mmap failed\n");
+		return 1;
+	}
+
+	try {
+		SharedState *state = static_cast<SharedState *>(mem);
+
+		if (::sysconf(_SC_NPROCESSORS_ONLN) < 2)
+			std::fprintf(stderr, "warning: polling needs at least two CPUs\n");
+
+		std::printf("%d round trips, %u byte commands\n", round_trips, COMMAND_SIZE);
+		std::printf("%-14s %8s %9s %9s %9s %13s\n", "mode", "spin us", "mean us", "p50 us", "p99 us", "signals/trip");
+
+		for (const Mode &mode : modes) {
+			Result result = run(state, mode, round_trips);
+			std::printf("%-14s %8u %9.2f %9.2f %9.2f %13.2f\n",
+				mode.name, mode.spin_us, result.mean_us, result.p50_us, result.p99_us, result.signals_per_trip);
+		}
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		::munmap(mem, sizeof(SharedState));
+		return 1;
+	}
+
+	::munmap(mem, sizeof(SharedState));
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <new>
+#include "frame_pool.h"
+
+namespace ipc_client {
+
+FramePool::FramePool(size_t depth) :
+	m_depth{ depth },
+	m_cached_blocks{},
+	m_hits{},
+	m_misses{}
+{}
+
+void *FramePool::acquire(size_t size)
+{
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	for (auto it = m_cache.lower_bound(size); it != m_cache.end() && it->first - size <= size / 8; ++it) {
+		if (it->second.empty())
+			continue;
+
+		void *ptr = it->second.back();
+		it->second.pop_back();
+		--m_cached_blocks;
+		++m_hits;
+		return ptr;
+	}
+
+	++m_misses;
+	return nullptr;
+}
+
+bool FramePool::release(size_t usable_size, void *ptr)
+{
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	try {
+		std::vector<void *> &blocks = m_cache[usable_size];
+
+		if (blocks.size() >= m_depth)
+			return false;
+
+		if (blocks.capacity() < m_depth)
+			blocks.reserve(m_depth);
+
+		blocks.push_back(ptr);
+	} catch (const std::bad_alloc &) {
+		return false;
+	}
+
+	++m_cached_blocks;
+	return true;
+}
+
+std::vector<void *> FramePool::drain()
+{
+	std::vector<void *> ret;
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	ret.reserve(m_cached_blocks);
+
+	for (auto &entry : m_cache) {
+		ret.insert(ret.end(), entry.second.begin(), entry.second.end());
+		entry.second.clear();
+	}
+
+	m_cached_blocks = 0;
+	return ret;
+}
+
+FramePool::Stats FramePool::stats() const
+{
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	return{ m_hits, m_misses, m_cached_blocks };
+}
+
+} // namespace ipc_client
@@ -0,0 +1,54 @@
+#pragma once
+
+#ifndef IPC_FRAME_POOL_H_
+#define IPC_FRAME_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace ipc_client {
+
+// Cache of released frame buffers on the IPC heap, keyed by usable size.
+// The pool does not allocate or free heap memory itself.
+class FramePool {
+public:
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		size_t cached_blocks;
+	};
+private:
+	std::map<size_t, std::vector<void *>> m_cache;
+	size_t m_depth;
+	size_t m_cached_blocks;
+	mutable std::mutex m_mutex;
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+public:
+	// Cache up to (depth) buffers for each distinct size.
+	explicit FramePool(size_t depth = 4);
+
+	FramePool(const FramePool &) = delete;
+	FramePool &operator=(const FramePool &) = delete;
+
+	// Get a cached buffer of at least (size) bytes, or null on a miss. Buffers
+	// more than an eighth larger than requested are not used.
+	void *acquire(size_t size);
+
+	// Offer a buffer of (usable_size) bytes to the pool. Returns false if the
+	// pool is full, in which case the caller must free the buffer.
+	bool release(size_t usable_size, void *ptr);
+
+	// Remove all cached buffers from the pool. The caller must free them.
+	std::vector<void *> drain();
+
+	Stats stats() const;
+};
+
+} // namespace ipc_client
+
+#endif // IPC_FRAME_POOL_H_
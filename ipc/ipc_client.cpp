@@ -1,69 +1,91 @@
 #include <cassert>
+#include <chrono>
 #include <cstdint>
-#include <cwchar>
 #include <condition_variable>
+#include <cstring>
 #include <new>
-#include <string>
 #include <utility>
 #include <vector>
-#include <Windows.h>
 #include "ipc_client.h"
 #include "ipc_commands.h"
 #include "ipc_types.h"
 #include "logging.h"
+#include "platform.h"
+#include "video_types.h"
 
 namespace ipc_client {
 
 namespace {
 
-constexpr uint32_t QUEUE_SIZE = 4096;
-constexpr uint32_t SHMEM_SIZE = 256 * (1UL << 20);
+// Shared memory is reserved up front and committed on demand.
+constexpr uint32_t COMMIT_GRANULARITY = 4 * (1UL << 20);
 
-std::wstring create_slave_command(const std::wstring &slave_path, ::HANDLE shmem_handle, uint32_t shmem_size)
+// Frame payloads start on a page boundary.
+constexpr uint32_t FRAME_ALIGNMENT = 4096;
+
+// Write a descriptor of a command that was spilled to the heap.
+void serialize_spilled_command(void *buf, const ipc::Command *command, uint32_t command_offset)
+{
+	ipc::Command *descriptor = new (buf) ipc::Command{ *command };
+	std::memcpy(descriptor->magic, "cmdh", sizeof(descriptor->magic));
+	descriptor->size = sizeof(ipc::Command) + sizeof(ipc::SpilledCommand);
+	new (ipc::offset_to_pointer<void>(descriptor, sizeof(ipc::Command))) ipc::SpilledCommand{ command_offset, command->size };
+}
+
+ipc::Queue *init_queue(void *ptr, uint32_t size)
 {
-#define FORMAT L"\"%s\" %u %u %u", slave_path.c_str(), ::GetCurrentProcessId(), HandleToULong(shmem_handle), shmem_size
-	if (slave_path.empty() || slave_path.find(L'"') != std::wstring::npos || slave_path.back() == L'/' || slave_path.back() == L'\\')
-		throw IPCError{ "invalid characters in path" };
+	ipc::Queue *queue = new (ptr) ipc::Queue{};
+	queue->size = size;
+	return queue;
+}
 
-	std::wstring cmd(MAX_PATH, L'\0');
+ipc::Queue *map_queue(ipc::SharedMemoryHeader *header, uint32_t offset)
+{
+	if (offset > header->size - sizeof(ipc::Queue))
+		throw IPCError{ "pointer out of bounds" };
 
-	while (std::swprintf(&cmd[0], cmd.size(), FORMAT) < 0) {
-		cmd.resize(cmd.size() * 2);
-	}
+	ipc::Queue *queue = ipc::offset_to_pointer<ipc::Queue>(header, offset);
+	if (!ipc::check_fourcc(queue->magic, "cmdq"))
+		throw IPCError{ "bad queue header" };
+	if (queue->size > header->size - offset || queue->buffer_offset > queue->size - sizeof(ipc::Command))
+		throw IPCError{ "pointer out of bounds" };
 
-	return cmd;
-#undef FORMAT
+	return queue;
 }
 
-void wait_remote_process_write(::HANDLE event, ::HANDLE process)
+void commit_memory(void *ptr, size_t size)
 {
-	::HANDLE handles[2] = { event, process };
-	::DWORD result = ::WaitForMultipleObjects(sizeof(handles) / sizeof(::HANDLE), handles, FALSE, INFINITE);
+	if (!platform::commit_memory(ptr, size))
+		platform::trap_error("error committing shared memory");
+}
 
-	switch (result) {
-	case WAIT_OBJECT_0:
-		return;
-	case WAIT_OBJECT_0 + 1:
-		throw IPCError{ "remote process terminated unexpectedly" };
-	case WAIT_ABANDONED_0:
-	case WAIT_ABANDONED_0 + 1:
-		::SetLastError(ERROR_ABANDONED_WAIT_0);
-		win32::trap_error("remote process abandoned event");
-		break;
-	case WAIT_TIMEOUT:
-		::SetLastError(ERROR_TIMEOUT);
-		win32::trap_error();
-		break;
-	case WAIT_FAILED:
-		win32::trap_error("failed to wait for event");
-		break;
-	default:
-		::SetLastError(ERROR_UNIDENTIFIED_ERROR);
-		win32::trap_error("unknown error while waiting on event");
-		break;
+uint32_t commit_heap(ipc::Heap *heap, uint32_t size)
+{
+	uint32_t committed = heap->committed_size.load(std::memory_order_relaxed);
+
+	size += COMMIT_GRANULARITY - 1;
+	size -= size % COMMIT_GRANULARITY;
+	size = size < heap->size ? size : heap->size;
+
+	if (!platform::commit_memory(ipc::offset_to_pointer<void>(heap, committed), size - committed)) {
+		ipc_log("error committing %u bytes: %d\n", size - committed, platform::last_error());
+		return 0;
 	}
+
+	return size;
 }
 
+void log_heap_stats(const char *name, const ipc::HeapStats &stats)
+{
+	ipc_log("%s heap: %u/%u bytes in use (peak %u, %u committed), %u blocks, largest free %u (%.1f%% fragmented), "
+	        "%llu allocations (%.2f/%u nodes scanned), %u failures\n",
+	        name, stats.bytes_in_use, stats.capacity, stats.peak_bytes_in_use, stats.committed, stats.live_blocks,
+	        stats.largest_free_block, stats.fragmentation * 100.0,
+	        static_cast<unsigned long long>(stats.alloc_count), stats.avg_nodes_scanned, stats.max_nodes_scanned,
+	        stats.alloc_failures);
+}
+
+#ifdef _DEBUG
 void print_heap(const ipc::Heap *heap)
 {
 	const ipc::HeapNode *base = ipc::offset_to_pointer<const ipc::HeapNode>(heap, heap->buffer_offset);
@@ -80,112 +102,196 @@ void print_heap(const ipc::Heap *heap)
 		node = ipc::offset_to_pointer<const ipc::HeapNode>(base, node->next_node_offset);
 	};
 }
+#endif
 
 } // namespace
 
 
+// Completion of a synchronous send. The waiter polls for the spin time before
+// sleeping, as responses to small requests often arrive within it.
+class IPCClient::SyncWaiter {
+	std::unique_ptr<Command> m_result;
+	std::atomic_bool m_done;
+	std::atomic_bool m_sleeping;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+public:
+	SyncWaiter() : m_done{}, m_sleeping{} {}
+
+	void reset()
+	{
+		m_result.reset();
+		m_done.store(false, std::memory_order_relaxed);
+	}
+
+	// Called from the receiver thread. The waiter may return as soon as the
+	// result is published, but it stays in the pool, so it remains valid.
+	void complete(std::unique_ptr<Command> c)
+	{
+		m_result = std::move(c);
+		m_done.store(true, std::memory_order_seq_cst);
+
+		if (m_sleeping.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_cond.notify_one();
+		}
+	}
+
+	std::unique_ptr<Command> wait(uint32_t spin_time)
+	{
+		if (spin_time) {
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds{ spin_time };
+
+			for (unsigned i = 1; !m_done.load(std::memory_order_acquire); ++i) {
+				if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline)
+					break;
+				platform::cpu_relax();
+			}
+		}
+
+		// Pairs with complete: either it sees the sleeping flag, or the
+		// predicate sees the result.
+		if (!m_done.load(std::memory_order_acquire)) {
+			std::unique_lock<std::mutex> lock{ m_mutex };
+			m_sleeping.store(true, std::memory_order_seq_cst);
+			m_cond.wait(lock, [&]() { return m_done.load(std::memory_order_seq_cst); });
+			m_sleeping.store(false, std::memory_order_relaxed);
+		}
+
+		return std::move(m_result);
+	}
+};
+
+
 IPCClient::IPCClient(bool master) :
 	m_master_queue{},
+	m_master_urgent_queue{},
 	m_slave_queue{},
-	m_heap{},
+	m_slave_urgent_queue{},
+	m_send_stats{},
+	m_send_timeout{ DEFAULT_SEND_TIMEOUT },
+	m_spin_time{ DEFAULT_SPIN_TIME },
+	m_master_heap{},
+	m_slave_heap{},
+	m_deferred_frees{},
+	m_deferred_free_threshold{ DEFAULT_DEFERRED_FREE_THRESHOLD },
 	m_remote_process{},
 	m_master{ master },
-	m_transaction_id{},
-	m_kill_flag{}
-{}
+	m_kill_flag{},
+	m_recv_thread_id{ std::thread::id{} }
+{
+	// Polling only helps if the remote process can run at the same time.
+	if (platform::processor_count() < 2)
+		m_spin_time = 0;
+}
 
-IPCClient::IPCClient(master_tag, const wchar_t *slave_path) : IPCClient{ true }
+IPCClient::IPCClient(master_tag, const platform::path_char *slave_path, uint32_t heap_size, uint32_t queue_size, bool large_pages, uint32_t warm_up_size, bool lock_memory) :
+	IPCClient{ true }
 {
-	::SECURITY_ATTRIBUTES inheritable_attributes{ sizeof(::SECURITY_ATTRIBUTES), nullptr, TRUE };
+	if (queue_size < MIN_QUEUE_SIZE || queue_size > MAX_QUEUE_SIZE)
+		throw IPCError{ "invalid queue size" };
+	if (heap_size < MIN_HEAP_SIZE || heap_size > MAX_HEAP_SIZE)
+		throw IPCError{ "invalid heap size" };
 
-	// Allocate and map shared memory.
-	ipc_log0("allocate shared memory\n");
+	queue_size += alignof(ipc::Queue) - 1;
+	queue_size -= queue_size % alignof(ipc::Queue);
+	heap_size += alignof(ipc::Heap) - 1;
+	heap_size -= heap_size % alignof(ipc::Heap);
 
-	m_shmem_handle.reset(::CreateFileMappingW(INVALID_HANDLE_VALUE, &inheritable_attributes, PAGE_READWRITE, 0, SHMEM_SIZE, nullptr));
-	if (!m_shmem_handle)
-		win32::trap_error("error allocating IPC shared memory");
+	uint32_t shmem_size = sizeof(ipc::SharedMemoryHeader) + queue_size * 2 + URGENT_QUEUE_SIZE * 2 + heap_size * 2;
 
-	m_shmem.reset(::MapViewOfFile(m_shmem_handle.get().h, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, SHMEM_SIZE));
-	if (!m_shmem)
-		win32::trap_error("error mapping shared memory");
+	// Allocate and map shared memory. Large page sections are committed in
+	// full, and may be larger than requested.
+	ipc_log("allocate shared memory: %u bytes heap, %u bytes queue\n", heap_size, queue_size);
 
-	// Create synchronization events.
-	ipc_log0("initialize Win32 objects\n");
+	m_shmem = platform::SharedMemory::create(shmem_size, large_pages);
+	if (m_shmem.size() > MAX_SHMEM_SIZE)
+		throw IPCError{ "shared memory too large" };
+	shmem_size = static_cast<uint32_t>(m_shmem.size());
+	large_pages = m_shmem.large_pages();
 
-	m_master_event.reset(::CreateEventW(&inheritable_attributes, FALSE, FALSE, nullptr));
-	if (!m_master_event)
-		win32::trap_error("error creating synchronization object");
-	m_master_mutex.reset(::CreateMutexW(&inheritable_attributes, FALSE, nullptr));
-	if (!m_master_mutex)
-		win32::trap_error("error creating synchronization object");
+	// Initialize IPC structures.
+	if (!large_pages)
+		commit_memory(m_shmem.get(), sizeof(ipc::SharedMemoryHeader) + queue_size * 2 + URGENT_QUEUE_SIZE * 2);
 
-	m_slave_event.reset(::CreateEventW(&inheritable_attributes, FALSE, FALSE, nullptr));
-	if (!m_slave_event)
-		win32::trap_error("error creating synchronization object");
-	m_slave_mutex.reset(::CreateMutexW(&inheritable_attributes, FALSE, nullptr));
-	if (!m_slave_mutex)
-		win32::trap_error("error creating synchronization object");
+	ipc::SharedMemoryHeader *header = new (m_shmem.get()) ipc::SharedMemoryHeader{};
+	header->size = shmem_size;
 
-	m_heap_mutex.reset(::CreateMutexW(&inheritable_attributes, FALSE, nullptr));
-	if (!m_heap_mutex)
-		win32::trap_error("error creating synchronization object");
+	m_master_queue = init_queue(ipc::offset_to_pointer<void>(header, sizeof(ipc::SharedMemoryHeader)), queue_size);
+	m_slave_queue = init_queue(ipc::offset_to_pointer<void>(m_master_queue, queue_size), queue_size);
+	m_master_urgent_queue = init_queue(ipc::offset_to_pointer<void>(m_slave_queue, queue_size), URGENT_QUEUE_SIZE);
+	m_slave_urgent_queue = init_queue(ipc::offset_to_pointer<void>(m_master_urgent_queue, URGENT_QUEUE_SIZE), URGENT_QUEUE_SIZE);
 
-	// Initialize IPC structures.
-	ipc::SharedMemoryHeader *header = new (m_shmem.get()) ipc::SharedMemoryHeader{};
-	header->size = SHMEM_SIZE;
+	// Create synchronization events. The urgent queues wake the same receiver
+	// as the regular queues.
+	ipc_log0("initialize synchronization objects\n");
 
-	m_master_queue = new (ipc::offset_to_pointer<void>(header, sizeof(ipc::SharedMemoryHeader))) ipc::Queue{};
-	m_master_queue->size = QUEUE_SIZE;
-	m_master_queue->event_handle = HandleToULong(m_master_event.get().h);
-	m_master_queue->mutex_handle = HandleToULong(m_master_mutex.get().h);
+	m_master_event.create(&header->master_event);
+	m_master_space_event.create(&m_master_queue->space_event);
+	m_master_urgent_space_event.create(&m_master_urgent_queue->space_event);
 
-	m_slave_queue = new (ipc::offset_to_pointer<void>(m_master_queue, QUEUE_SIZE)) ipc::Queue{};
-	m_slave_queue->size = QUEUE_SIZE;
-	m_slave_queue->event_handle = HandleToULong(m_slave_event.get().h);
-	m_slave_queue->mutex_handle = HandleToULong(m_slave_mutex.get().h);
+	m_slave_event.create(&header->slave_event);
+	m_slave_space_event.create(&m_slave_queue->space_event);
+	m_slave_urgent_space_event.create(&m_slave_urgent_queue->space_event);
 
-	m_heap = new (ipc::offset_to_pointer<void>(m_slave_queue, QUEUE_SIZE)) ipc::Heap{};
-	m_heap->size = SHMEM_SIZE - ipc::pointer_to_offset(header, m_heap);
-	m_heap->mutex_handle = HandleToULong(m_heap_mutex.get().h);
+	// Only the heap headers are committed initially.
+	uint32_t heap_committed = large_pages ? heap_size : sizeof(ipc::Heap) + sizeof(ipc::HeapNode);
 
-	new (ipc::offset_to_pointer<void>(m_heap, m_heap->buffer_offset)) ipc::HeapNode{};
+	void *master_heap_ptr = ipc::offset_to_pointer<void>(m_slave_urgent_queue, URGENT_QUEUE_SIZE);
+	if (!large_pages)
+		commit_memory(master_heap_ptr, heap_committed);
 
-	header->master_queue_offset = ipc::pointer_to_offset(header, m_master_queue);
-	header->slave_queue_offset = ipc::pointer_to_offset(header, m_slave_queue);
-	header->heap_offset = ipc::pointer_to_offset(header, m_heap);
+	m_master_heap = new (master_heap_ptr) ipc::Heap{};
+	m_master_heap->size = heap_size;
+	m_master_heap->committed_size = heap_committed;
+	ipc::heap_init(m_master_heap);
 
-	// Start slave process.
-	std::wstring slave_command = create_slave_command(slave_path, m_shmem_handle.get().h, SHMEM_SIZE);
-	ipc_wlog(L"start slave process: %s\n", slave_command.c_str());
+	void *slave_heap_ptr = ipc::offset_to_pointer<void>(m_master_heap, heap_size);
+	if (!large_pages)
+		commit_memory(slave_heap_ptr, heap_committed);
 
-	::STARTUPINFO startup_info{ sizeof(::STARTUPINFO) };
-	::PROCESS_INFORMATION process_info{};
+	m_slave_heap = new (slave_heap_ptr) ipc::Heap{};
+	m_slave_heap->size = heap_size;
+	m_slave_heap->committed_size = heap_committed;
+	ipc::heap_init(m_slave_heap);
 
-#ifdef _DEBUG
-  #define FLAGS CREATE_NEW_CONSOLE
-#else
-  #define FLAGS CREATE_NO_WINDOW
-#endif
-	if (!::CreateProcessW(nullptr, &slave_command[0], nullptr, nullptr, TRUE, FLAGS, nullptr, nullptr, &startup_info, &process_info))
-		win32::trap_error("error starting slave process");
-#undef FLAGS
+	header->master_queue_offset = ipc::pointer_to_offset(header, m_master_queue);
+	header->slave_queue_offset = ipc::pointer_to_offset(header, m_slave_queue);
+	header->master_urgent_queue_offset = ipc::pointer_to_offset(header, m_master_urgent_queue);
+	header->slave_urgent_queue_offset = ipc::pointer_to_offset(header, m_slave_urgent_queue);
+	header->master_heap_offset = ipc::pointer_to_offset(header, m_master_heap);
+	header->slave_heap_offset = ipc::pointer_to_offset(header, m_slave_heap);
+
+	// Commit the warm-up range before the slave attaches. Large pages are
+	// committed and locked at allocation.
+	if (warm_up_size && !large_pages) {
+		warm_up_size = warm_up_size < heap_size ? warm_up_size : heap_size;
+
+		for (ipc::Heap *heap : { m_master_heap, m_slave_heap }) {
+			uint32_t committed = commit_heap(heap, warm_up_size);
+			if (!committed)
+				platform::trap_error("error committing shared memory");
+			heap->committed_size = committed;
+		}
+
+		header->warm_up_size = warm_up_size;
+		header->warm_up_flags = lock_memory ? ipc::WARM_UP_LOCK : 0;
+		warm_up_heaps(header->warm_up_size, lock_memory);
+	}
 
-	ipc_log("slave process pid: %u\n", process_info.dwProcessId);
-	::CloseHandle(process_info.hThread);
-	m_remote_process = process_info.hProcess;
+	// Start slave process.
+	m_remote_process = platform::Process::spawn_slave(slave_path, m_shmem.handle(), shmem_size);
+	ipc_log("slave process pid: %u\n", m_remote_process.id());
 }
 
-IPCClient::IPCClient(slave_tag, ::HANDLE master_process, ::HANDLE shmem_handle, size_t shmem_size) : IPCClient{ false }
+IPCClient::IPCClient(slave_tag, platform::native_handle master_process, platform::native_handle shmem_handle, size_t shmem_size) : IPCClient{ false }
 {
-	ipc_log("open shared memory\n");
+	ipc_log0("open shared memory\n");
 
-	if (shmem_size < sizeof(ipc::SharedMemoryHeader))
+	if (shmem_size < sizeof(ipc::SharedMemoryHeader) || shmem_size > MAX_SHMEM_SIZE)
 		throw IPCError{ "wrong shared memory size" };
 
-	m_shmem_handle.reset(shmem_handle);
-	m_shmem.reset(::MapViewOfFile(m_shmem_handle.get().h, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, shmem_size));
-	if (!m_shmem)
-		win32::trap_error("error mapping shared memory");
+	m_shmem = platform::SharedMemory::open(shmem_handle, shmem_size);
 
 	ipc::SharedMemoryHeader *header = static_cast<ipc::SharedMemoryHeader *>(m_shmem.get());
 	if (!ipc::check_fourcc(header->magic, "avsw"))
@@ -194,47 +300,50 @@ IPCClient::IPCClient(slave_tag, ::HANDLE master_process, ::HANDLE shmem_handle,
 		throw IPCError{ "wrong shared memory size" };
 	if (header->version != ipc::VERSION)
 		throw IPCError{ "IPC version mismatch" };
-	if (header->slave_queue_offset > header->size - sizeof(ipc::Queue) ||
-	    header->master_queue_offset > header->size - sizeof(ipc::Queue) ||
-	    header->heap_offset > header->size - sizeof(ipc::Heap))
+	if (header->master_heap_offset > header->size - sizeof(ipc::Heap) ||
+	    header->slave_heap_offset > header->size - sizeof(ipc::Heap))
 	{
 		throw IPCError{ "pointer out of bounds" };
 	}
 
-	m_master_queue = ipc::offset_to_pointer<ipc::Queue>(header, header->master_queue_offset);
-	if (!ipc::check_fourcc(m_master_queue->magic, "cmdq"))
-		throw IPCError{ "bad queue header" };
-	if (m_master_queue->size > header->size - header->master_queue_offset ||
-	    m_master_queue->buffer_offset > m_master_queue->size - sizeof(ipc::Command))
-	{
-		throw IPCError{ "pointer out of bounds" };
-	}
+	m_master_queue = map_queue(header, header->master_queue_offset);
+	m_slave_queue = map_queue(header, header->slave_queue_offset);
+	m_master_urgent_queue = map_queue(header, header->master_urgent_queue_offset);
+	m_slave_urgent_queue = map_queue(header, header->slave_urgent_queue_offset);
 
-	m_slave_queue = ipc::offset_to_pointer<ipc::Queue>(header, header->slave_queue_offset);
-	if (!ipc::check_fourcc(m_slave_queue->magic, "cmdq"))
-		throw IPCError{ "bad queue header" };
-	if (m_slave_queue->size > header->size - header->slave_queue_offset ||
-	    m_slave_queue->buffer_offset > m_slave_queue->size - sizeof(ipc::Command))
+	m_master_heap = ipc::offset_to_pointer<ipc::Heap>(header, header->master_heap_offset);
+	if (!ipc::check_fourcc(m_master_heap->magic, "heap"))
+		throw IPCError{ "bad heap header" };
+	if (m_master_heap->policy != ipc::HeapPolicy::id)
+		throw IPCError{ "heap policy mismatch" };
+	if (m_master_heap->size > header->size - header->master_heap_offset ||
+	    m_master_heap->buffer_offset > m_master_heap->size - sizeof(ipc::HeapNode))
 	{
 		throw IPCError{ "pointer out of bounds" };
 	}
 
-	m_heap = ipc::offset_to_pointer<ipc::Heap>(header, header->heap_offset);
-	if (!ipc::check_fourcc(m_heap->magic, "heap"))
+	m_slave_heap = ipc::offset_to_pointer<ipc::Heap>(header, header->slave_heap_offset);
+	if (!ipc::check_fourcc(m_slave_heap->magic, "heap"))
 		throw IPCError{ "bad heap header" };
-	if (m_heap->size > header->size - header->heap_offset ||
-	    m_heap->buffer_offset > m_heap->size - sizeof(ipc::HeapNode))
+	if (m_slave_heap->policy != ipc::HeapPolicy::id)
+		throw IPCError{ "heap policy mismatch" };
+	if (m_slave_heap->size > header->size - header->slave_heap_offset ||
+	    m_slave_heap->buffer_offset > m_slave_heap->size - sizeof(ipc::HeapNode))
 	{
 		throw IPCError{ "pointer out of bounds" };
 	}
 
-	m_master_event.reset(ULongToHandle(m_master_queue->event_handle));
-	m_master_mutex.reset(ULongToHandle(m_master_queue->mutex_handle));
-	m_slave_event.reset(ULongToHandle(m_slave_queue->event_handle));
-	m_slave_mutex.reset(ULongToHandle(m_slave_queue->mutex_handle));
-	m_heap_mutex.reset(ULongToHandle(m_heap->mutex_handle));
+	m_master_event.open(&header->master_event);
+	m_master_space_event.open(&m_master_queue->space_event);
+	m_master_urgent_space_event.open(&m_master_urgent_queue->space_event);
+	m_slave_event.open(&header->slave_event);
+	m_slave_space_event.open(&m_slave_queue->space_event);
+	m_slave_urgent_space_event.open(&m_slave_urgent_queue->space_event);
+
+	m_remote_process = platform::Process{ master_process };
 
-	m_remote_process = master_process;
+	if (header->warm_up_size)
+		warm_up_heaps(header->warm_up_size, !!(header->warm_up_flags & ipc::WARM_UP_LOCK));
 }
 
 IPCClient::~IPCClient()
@@ -245,23 +354,26 @@ IPCClient::~IPCClient()
 		ipc_log_current_exception();
 	}
 
-	if (m_master) {
-		ipc_log("terminate slave process\n");
-		::Sleep(100);
-		::TerminateProcess(m_remote_process, 0);
-		::CloseHandle(m_remote_process);
-	}
-}
+	FramePool::Stats stats = m_frame_pool.stats();
+	ipc_log("frame pool: %llu hits, %llu misses, %zu cached\n",
+		static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses), stats.cached_blocks);
 
-uint32_t IPCClient::next_transaction_id()
-{
-	uint32_t transaction_id;
+	for (Priority priority : { Priority::NORMAL, Priority::URGENT }) {
+		QueueStats queue_stats = send_queue_stats(priority);
+		ipc_log("%s send queue: %llu stalls (%llu us, max %llu us), %llu timeouts\n", priority == Priority::URGENT ? "urgent" : "regular",
+			static_cast<unsigned long long>(queue_stats.stalls), static_cast<unsigned long long>(queue_stats.stall_time_us),
+			static_cast<unsigned long long>(queue_stats.max_stall_us), static_cast<unsigned long long>(queue_stats.timeouts));
+	}
 
-	do {
-		transaction_id = m_transaction_id++;
-	} while (transaction_id == INVALID_TRANSACTION);
+	if (m_master_heap && m_slave_heap) {
+		log_heap_stats("master", master_heap_stats());
+		log_heap_stats("slave", slave_heap_stats());
+	}
 
-	return transaction_id;
+	if (m_master) {
+		ipc_log0("terminate slave process\n");
+		m_remote_process.terminate();
+	}
 }
 
 void IPCClient::recv_thread_func()
@@ -269,10 +381,13 @@ void IPCClient::recv_thread_func()
 	std::unique_ptr<Command> command;
 	std::exception_ptr eptr;
 
+	m_recv_thread_id = std::this_thread::get_id();
+
 	// Exception safety: exceptions on the receiver thread are session-fatal. Heap cleanup is not required.
 	try {
-		std::vector<unsigned char> command_buf;
-		command_buf.reserve(QUEUE_SIZE);
+		// Commands are parsed in place, except for those that wrap around the
+		// end of the queue. Larger commands are spilled to the heap.
+		std::vector<unsigned char> scratch(MAX_INLINE_COMMAND_SIZE);
 
 		while (true) {
 			if (m_kill_flag) {
@@ -280,56 +395,74 @@ void IPCClient::recv_thread_func()
 				break;
 			}
 
-			wait_remote_process_write(recv_event(), m_remote_process);
+			wait_recv_commands();
 
-			{
-				win32::MutexGuard lock{ recv_mutex() };
-				command_buf.resize(recv_queue()->buffer_usage);
-				ipc::queue_read(recv_queue(), command_buf.data());
-			}
+			// The event may have been set for commands that were already read.
+			// The urgent queue is checked again before each regular command.
+			while (true) {
+				Priority priority = ipc::queue_readable(recv_queue(Priority::URGENT)) ? Priority::URGENT : Priority::NORMAL;
+				ipc::Queue *queue = recv_queue(priority);
 
-			size_t pos = 0;
-			while (pos < command_buf.size()) {
-				if (command_buf.size() - pos < sizeof(ipc::Command))
+				uint32_t readable = ipc::queue_readable(queue);
+				if (!readable)
+					break;
+				if (readable < sizeof(ipc::Command))
 					throw IPCError{ "pointer out of bounds" };
 
-				const ipc::Command *raw_command = reinterpret_cast<const ipc::Command *>(command_buf.data() + pos);
-				if (!ipc::check_fourcc(raw_command->magic, "cmdx"))
+				const ipc::Command *raw_command = static_cast<const ipc::Command *>(ipc::queue_peek(queue, 0, sizeof(ipc::Command), scratch.data()));
+				if (!ipc::check_fourcc(raw_command->magic, "cmdx") && !ipc::check_fourcc(raw_command->magic, "cmdh"))
 					throw IPCError{ "bad command header" };
-				if (raw_command->size > command_buf.size() - pos)
+				if (raw_command->size < sizeof(ipc::Command) || raw_command->size > readable || raw_command->size > MAX_INLINE_COMMAND_SIZE)
 					throw IPCError{ "pointer out of bounds" };
+				if (raw_command->size % alignof(ipc::Command))
+					throw IPCError{ "bad command header" };
 
-				ipc_log("received command type %d: %u => %u\n", raw_command->type, raw_command->response_id, raw_command->transaction_id);
+				uint32_t command_size = raw_command->size;
+				raw_command = static_cast<const ipc::Command *>(ipc::queue_peek(queue, 0, command_size, scratch.data()));
 
-				command = deserialize_command(raw_command);
-				pos += raw_command->size;
+				// Spilled commands are parsed in place in the heap, and freed
+				// once they are handled.
+				void *spilled = nullptr;
+				if (ipc::check_fourcc(raw_command->magic, "cmdh")) {
+					spilled = find_spilled_command(raw_command);
+					raw_command = static_cast<const ipc::Command *>(spilled);
+				}
 
-				if (!command) {
-					ipc_log0("failed to deserialize command\n");
+				CommandView view{ raw_command };
+
+				ipc_log("received command type %d: %u => %u\n", raw_command->type, raw_command->response_id, raw_command->transaction_id);
 
-					if (raw_command->response_id != INVALID_TRANSACTION) {
-						std::lock_guard<std::mutex> lock{ m_worker_mutex };
-						auto it = m_callbacks.find(command->response_id());
+				callback_type callback;
 
-						if (it != m_callbacks.end()) {
-							it->second(nullptr);
-							m_callbacks.erase(it);
-						}
-					}
+				if (view.response_id() != INVALID_TRANSACTION)
+					callback = m_transactions.take(view.response_id());
 
+				// Only materialize commands that are not handled in place.
+				if (!callback && m_view_cb && m_view_cb(view)) {
+					release_recv_space(priority, command_size);
+					if (spilled)
+						deallocate(spilled);
 					continue;
 				}
 
-				callback_type callback;
+				try {
+					command = view.materialize();
+				} catch (...) {
+					if (callback)
+						callback(nullptr);
+					throw;
+				}
 
-				if (command->response_id() != INVALID_TRANSACTION) {
-					std::lock_guard<std::mutex> lock{ m_worker_mutex };
-					auto it = m_callbacks.find(command->response_id());
+				release_recv_space(priority, command_size);
+				if (spilled)
+					deallocate(spilled);
 
-					if (it != m_callbacks.end()) {
-						callback = std::move(it->second);
-						m_callbacks.erase(it);
-					}
+				if (!command) {
+					ipc_log0("failed to deserialize command\n");
+
+					if (callback)
+						callback(nullptr);
+					continue;
 				}
 
 				if (callback) {
@@ -352,32 +485,135 @@ void IPCClient::recv_thread_func()
 			command->relinquish_heap_resources();
 	}
 
-	// Record exception information and wake all waiters.
+	// Record exception information and wake all waiters. Senders that see the
+	// kill flag complete their own callbacks.
 	std::lock_guard<std::mutex> lock{ m_worker_mutex };
 	m_recv_exception = eptr;
+	m_kill_flag = true;
 
-	for (auto it = m_callbacks.begin(); it != m_callbacks.end(); ) {
-		it->second(nullptr);
-		it = m_callbacks.erase(it);
-	}
+	m_transactions.fail_all();
 	if (m_default_cb)
 		m_default_cb(nullptr);
+}
 
-	m_kill_flag = true;
+void IPCClient::wait_send_space(Priority priority, uint32_t size)
+{
+	ipc::Queue *queue = send_queue(priority);
+	QueueStats &stats = m_send_stats[static_cast<int>(priority)];
+
+	if (size >= queue->size - queue->buffer_offset)
+		throw IPCError{ "command larger than queue" };
+	if (ipc::queue_writable(queue) >= size)
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+	bool timed_out = false;
+
+	while (true) {
+		// Ask the reader to signal after reading, then check again in case it
+		// already has.
+		queue->writer_waiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (ipc::queue_writable(queue) >= size)
+			break;
+
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() >= m_send_timeout) {
+			timed_out = true;
+			break;
+		}
+
+		send_space_event(priority).wait(m_remote_process, static_cast<uint32_t>(m_send_timeout - elapsed.count()));
+	}
+
+	queue->writer_waiting.store(0, std::memory_order_relaxed);
+
+	uint64_t stall_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	++stats.stalls;
+	stats.stall_time_us += stall_us;
+	stats.max_stall_us = stall_us > stats.max_stall_us ? stall_us : stats.max_stall_us;
+
+	if (timed_out) {
+		++stats.timeouts;
+		ipc_log("send queue full for %llu us\n", static_cast<unsigned long long>(stall_us));
+		throw IPCError{ "timed out waiting for queue space" };
+	}
 }
 
-void IPCClient::start(callback_type default_cb)
+void IPCClient::release_recv_space(Priority priority, uint32_t size)
+{
+	ipc::Queue *queue = recv_queue(priority);
+	ipc::queue_consume(queue, size);
+
+	// Wake a writer waiting for space. Pairs with the fence in wait_send_space.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue->writer_waiting.exchange(0, std::memory_order_relaxed))
+		recv_space_event(priority).set();
+}
+
+void *IPCClient::find_spilled_command(const ipc::Command *descriptor) const
+{
+	if (descriptor->size != sizeof(ipc::Command) + sizeof(ipc::SpilledCommand))
+		throw IPCError{ "bad command header" };
+
+	const ipc::SpilledCommand *spilled = ipc::offset_to_pointer<const ipc::SpilledCommand>(descriptor, sizeof(ipc::Command));
+	void *ptr = offset_to_pointer(spilled->command_offset);
+	if (!ptr)
+		throw IPCError{ "pointer out of bounds" };
+
+	ipc::HeapNode *node = pointer_to_node(ptr);
+	if (spilled->size < sizeof(ipc::Command) || spilled->size > ipc::heap_usable_size(find_heap(node), node))
+		throw IPCError{ "pointer out of bounds" };
+
+	const ipc::Command *command = static_cast<const ipc::Command *>(ptr);
+	if (!ipc::check_fourcc(command->magic, "cmdx") || command->size != spilled->size)
+		throw IPCError{ "bad command header" };
+
+	return ptr;
+}
+
+void IPCClient::wait_recv_commands()
+{
+	ipc::Queue *queue = recv_queue(Priority::NORMAL);
+	ipc::Queue *urgent_queue = recv_queue(Priority::URGENT);
+
+	if (m_spin_time) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds{ m_spin_time };
+
+		for (unsigned i = 1; !m_kill_flag; ++i) {
+			if (ipc::queue_readable(urgent_queue) || ipc::queue_readable(queue))
+				return;
+			// Reading the clock is slower than polling the queue.
+			if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline)
+				break;
+			platform::cpu_relax();
+		}
+	}
+
+	// Ask the writers to signal, then check again in case either already
+	// wrote. Pairs with the fence in send_async.
+	queue->reader_waiting.store(1, std::memory_order_relaxed);
+	urgent_queue->reader_waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (!ipc::queue_readable(urgent_queue) && !ipc::queue_readable(queue) && !m_kill_flag)
+		recv_event().wait(m_remote_process);
+
+	queue->reader_waiting.store(0, std::memory_order_relaxed);
+	urgent_queue->reader_waiting.store(0, std::memory_order_relaxed);
+}
+
+void IPCClient::start(callback_type default_cb, view_callback_type view_cb)
 {
 	assert(!m_recv_thread);
 	assert(!m_kill_flag);
 
-	::DWORD exit_code = STILL_ACTIVE;
-	if (!::GetExitCodeProcess(m_remote_process, &exit_code))
-		win32::trap_error("error polling remote process");
-	if (exit_code != STILL_ACTIVE)
+	if (!m_remote_process.alive())
 		throw IPCError{ "remote process exited" };
 
 	m_default_cb = std::move(default_cb);
+	m_view_cb = std::move(view_cb);
 
 	ipc_log0("start IPC receiver thread\n");
 	m_recv_thread = std::make_unique<std::thread>(&IPCClient::recv_thread_func, this);
@@ -391,33 +627,78 @@ void IPCClient::stop()
 	ipc_log0("stop IPC receiver thread\n");
 	m_kill_flag = true;
 
-	if (!::SetEvent(recv_event())) {
-		try {
-			win32::trap_error("error interrupting IPC receiver thread");
-		} catch (...) {
-			ipc_log_current_exception();
-			std::terminate();
-		}
+	try {
+		recv_event().set();
+	} catch (...) {
+		ipc_log0("error interrupting IPC receiver thread\n");
+		ipc_log_current_exception();
+		std::terminate();
 	}
 
 	m_recv_thread->join();
 	m_recv_thread.reset();
-	m_callbacks.clear();
+	m_transactions.fail_all();
 
 	if (m_recv_exception) {
-		ipc_log("rethrow exception from receiver thread\n");
+		ipc_log0("rethrow exception from receiver thread\n");
 		std::exception_ptr eptr = m_recv_exception;
 		m_recv_exception = nullptr;
 		std::rethrow_exception(eptr);
 	}
 }
 
+ipc::Heap *IPCClient::find_heap(const void *ptr) const
+{
+	for (ipc::Heap *heap : { m_master_heap, m_slave_heap }) {
+		const unsigned char *heap_base = ipc::offset_to_pointer<const unsigned char>(heap, heap->buffer_offset);
+		const unsigned char *heap_end = ipc::offset_to_pointer<const unsigned char>(heap, heap->size);
+
+		if (ptr >= heap_base && ptr < heap_end)
+			return heap;
+	}
+
+	return nullptr;
+}
+
+ipc::HeapNode *IPCClient::pointer_to_node(void *ptr) const
+{
+	ipc::HeapNode *node = reinterpret_cast<ipc::HeapNode *>(static_cast<unsigned char *>(ptr) - sizeof(ipc::HeapNode));
+	if (!find_heap(node) || !ipc::check_fourcc(node->magic, "memz"))
+		throw IPCError{ "pointer not a heap block" };
+	return node;
+}
+
+void IPCClient::warm_up_heaps(uint32_t size, bool lock)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (ipc::Heap *heap : { m_master_heap, m_slave_heap }) {
+		uint32_t committed = heap->committed_size.load(std::memory_order_relaxed);
+		committed = committed < heap->size ? committed : heap->size;
+		platform::warm_up_memory(heap, size < committed ? size : committed, lock);
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	ipc_log("warm up %u bytes of each heap%s: %.1f ms\n", size, lock ? " (locked)" : "", elapsed.count());
+}
+
+void IPCClient::free_node(void *ptr)
+{
+	ipc::HeapNode *node = pointer_to_node(ptr);
+	ipc::Heap *heap = find_heap(node);
+
+	if (heap == local_heap())
+		ipc::heap_free(heap, node);
+	else
+		ipc::heap_free_remote(heap, node);
+}
+
 uint32_t IPCClient::pointer_to_offset(void *ptr) const
 {
 	if (!ptr)
 		return ipc::NULL_OFFSET;
 
-	return ipc::pointer_to_offset(ipc::offset_to_pointer<void>(m_heap, m_heap->buffer_offset), ptr);
+	return ipc::pointer_to_offset(m_shmem.get(), ptr);
 }
 
 void *IPCClient::offset_to_pointer(uint32_t off) const
@@ -425,23 +706,50 @@ void *IPCClient::offset_to_pointer(uint32_t off) const
 	if (off == ipc::NULL_OFFSET)
 		return nullptr;
 
-	if (off > m_heap->size - m_heap->buffer_offset)
+	void *ptr = ipc::offset_to_pointer<void>(m_shmem.get(), off);
+	if (!find_heap(ptr))
 		throw IPCError{ "pointer out of bounds" };
 
-	return ipc::offset_to_pointer<void>(ipc::offset_to_pointer<void>(m_heap, m_heap->buffer_offset), off);
+	return ptr;
 }
 
 void *IPCClient::allocate(size_t size)
+{
+	return allocate_aligned(size, alignof(ipc::HeapNode));
+}
+
+void *IPCClient::allocate_aligned(size_t size, uint32_t alignment)
 {
 	if (size > static_cast<uint32_t>(INT32_MAX))
 		throw IPCError{ "cannot allocate more than 2 GB" };
 
-	win32::MutexGuard lock{ m_heap_mutex.get().h };
-	ipc::HeapNode *node = ipc::heap_alloc(m_heap, static_cast<uint32_t>(size));
+	ipc::Heap *heap = local_heap();
+
+	std::lock_guard<std::mutex> lock{ m_heap_mutex };
+	drain_remote(heap);
+	ipc::HeapNode *node = ipc::heap_alloc_aligned(heap, static_cast<uint32_t>(size), alignment, commit_heap);
+
+	if (!node) {
+		// Return cached frame buffers to the heap and try again.
+		std::vector<void *> cached = m_frame_pool.drain();
+		if (!cached.empty()) {
+			ipc_log("heap full, releasing %zu cached frames\n", cached.size());
+
+			for (void *ptr : cached) {
+				free_node(ptr);
+			}
+			node = ipc::heap_alloc_aligned(heap, static_cast<uint32_t>(size), alignment, commit_heap);
+		}
+	}
+
 	if (!node) {
 		ipc_log("heap full, could not allocate %zu bytes\n", size);
-		print_heap(m_heap);
-		throw IPCHeapFull{ (m_heap->size - m_heap->buffer_offset) - m_heap->buffer_usage, size };
+		ipc::heap_update_stats(heap);
+		log_heap_stats(m_master ? "master" : "slave", ipc::heap_stats(heap));
+#ifdef _DEBUG
+		print_heap(heap);
+#endif
+		throw IPCHeapFull{ size, (heap->size - heap->buffer_offset) - heap->buffer_usage };
 	}
 
 	return ipc::offset_to_pointer<void>(node, sizeof(ipc::HeapNode));
@@ -452,63 +760,215 @@ void IPCClient::deallocate(void *ptr)
 	if (!ptr)
 		return;
 
-	ipc::HeapNode *node = reinterpret_cast<ipc::HeapNode *>(static_cast<unsigned char *>(ptr) - sizeof(ipc::HeapNode));
-	if (!ipc::check_fourcc(node->magic, "memz"))
-		throw IPCError{ "pointer not a heap block" };
+	ipc::HeapNode *node = pointer_to_node(ptr);
+	if (ipc::heap_release(node))
+		reclaim_node(node);
+}
+
+void IPCClient::reclaim_node(ipc::HeapNode *node)
+{
+	ipc::Heap *heap = find_heap(node);
+
+	if (heap != local_heap()) {
+		ipc::heap_free_remote(heap, node);
+		return;
+	}
+
+	if (!m_deferred_free_threshold) {
+		std::lock_guard<std::mutex> lock{ m_heap_mutex };
+		ipc::heap_free(heap, node);
+		return;
+	}
+
+	// Queue the block without locking. The queue is processed by the next
+	// allocation, or here once enough blocks are pending.
+	ipc::heap_free_remote(heap, node);
+
+	if (++m_deferred_frees >= m_deferred_free_threshold) {
+		std::lock_guard<std::mutex> lock{ m_heap_mutex };
+		drain_remote(heap);
+	}
+}
+
+void IPCClient::drain_remote(ipc::Heap *heap)
+{
+	m_deferred_frees = 0;
+	ipc::heap_drain_remote(heap, recycle_frame, this);
+}
 
-	win32::MutexGuard lock{ m_heap_mutex.get().h };
-	ipc::heap_free(m_heap, node);
+bool IPCClient::recycle_frame(void *opaque, ipc::Heap *heap, ipc::HeapNode *node)
+{
+	IPCClient *client = static_cast<IPCClient *>(opaque);
+
+	if (!(node->flags & ipc::HEAP_FLAG_FRAME))
+		return false;
+
+	return client->m_frame_pool.release(ipc::heap_usable_size(heap, node), ipc::offset_to_pointer<void>(node, sizeof(ipc::HeapNode)));
+}
+
+void IPCClient::retain(void *ptr)
+{
+	if (ptr)
+		ipc::heap_retain(pointer_to_node(ptr));
+}
+
+ipc::HeapStats IPCClient::heap_stats(ipc::Heap *heap) const
+{
+	if (heap == local_heap()) {
+		std::lock_guard<std::mutex> lock{ m_heap_mutex };
+		ipc::heap_update_stats(heap);
+	}
+
+	return ipc::heap_stats(heap);
+}
+
+ipc::HeapStats IPCClient::master_heap_stats() const
+{
+	return heap_stats(m_master_heap);
+}
+
+ipc::HeapStats IPCClient::slave_heap_stats() const
+{
+	return heap_stats(m_slave_heap);
+}
+
+void *IPCClient::allocate_frame(ipc::VideoFrame *frame)
+{
+	size_t size = ipc::video_frame_size(*frame);
+
+	// Frames freed by the other process return to the pool when it is drained.
+	if (local_heap()->remote_free_offset.load(std::memory_order_relaxed) != ipc::NULL_OFFSET) {
+		std::lock_guard<std::mutex> lock{ m_heap_mutex };
+		drain_remote(local_heap());
+	}
+
+	void *ptr = m_frame_pool.acquire(size);
+	if (ptr) {
+		pointer_to_node(ptr)->ref_count.store(1, std::memory_order_relaxed);
+	} else {
+		ptr = allocate_aligned(size, FRAME_ALIGNMENT);
+
+		// The flags are read when neighbouring blocks are freed.
+		std::lock_guard<std::mutex> lock{ m_heap_mutex };
+		pointer_to_node(ptr)->flags |= ipc::HEAP_FLAG_FRAME;
+	}
+
+	frame->heap_offset = pointer_to_offset(ptr);
+	return ptr;
 }
 
-void IPCClient::send_async(std::unique_ptr<Command> command, callback_type cb)
+void IPCClient::deallocate_frame(const ipc::VideoFrame &frame)
+{
+	void *ptr = offset_to_pointer(frame.heap_offset);
+	if (!ptr)
+		return;
+
+	ipc::HeapNode *node = pointer_to_node(ptr);
+	if (!ipc::heap_release(node))
+		return;
+
+	// Blocks from the remote heap go back to their owner, which recycles them
+	// when it drains its heap.
+	ipc::Heap *heap = find_heap(node);
+	if (heap == local_heap() && (node->flags & ipc::HEAP_FLAG_FRAME) && m_frame_pool.release(ipc::heap_usable_size(heap, node), ptr))
+		return;
+
+	reclaim_node(node);
+}
+
+void IPCClient::send_async(std::unique_ptr<Command> command, callback_type cb, Priority priority)
+{
+	send_async(*command, std::move(cb), priority);
+}
+
+void IPCClient::send_async(Command &command, callback_type cb, Priority priority)
 {
 	uint32_t transaction_id = INVALID_TRANSACTION;
+	void *spilled = nullptr;
 
 	if (m_kill_flag) {
-		stop();
+		command.deallocate_heap_resources(this);
+
+		// The receiver thread can not join itself.
+		if (std::this_thread::get_id() != m_recv_thread_id.load())
+			stop();
+		if (cb)
+			cb(nullptr);
 		return;
 	}
 
 	// Exception safety: strong guarantee for exceptions prior to queue write. Callback is never invoked on exception.
 	try {
 		if (cb) {
-			transaction_id = next_transaction_id();
-			command->set_transaction_id(transaction_id);
+			// The receiver thread completes transactions, so it can not wait
+			// for a slot.
+			bool on_recv_thread = std::this_thread::get_id() == m_recv_thread_id.load();
+			transaction_id = m_transactions.insert(std::move(cb), on_recv_thread ? 0 : m_send_timeout);
+			command.set_transaction_id(transaction_id);
+		}
 
-			std::lock_guard<std::mutex> lock{ m_worker_mutex };
-			m_callbacks[transaction_id] = std::move(cb);
+		size_t size = command.serialized_size();
+
+		// Large commands are passed through the heap, so that the queue can
+		// stay small.
+		if (size > MAX_INLINE_COMMAND_SIZE) {
+			spilled = allocate(size);
+			command.serialize(spilled);
+			ipc_log("spill command of %zu bytes to heap\n", size);
 		}
 
-		std::vector<unsigned char> data(command->serialized_size());
-		command->serialize(data.data());
+		uint32_t queued_size = spilled ? sizeof(ipc::Command) + sizeof(ipc::SpilledCommand) : static_cast<uint32_t>(size);
 
-		ipc_log("async send command type %d: %u\n", command->type(), transaction_id);
+		ipc_log("async send command type %d: %u%s\n", command.type(), transaction_id, priority == Priority::URGENT ? " (urgent)" : "");
 		{
-			win32::MutexGuard lock_guard{ send_mutex() };
-			ipc::queue_write(send_queue(), data.data(), static_cast<uint32_t>(data.size()));
+			std::lock_guard<std::mutex> lock{ m_send_mutex[static_cast<int>(priority)] };
+			wait_send_space(priority, queued_size);
+
+			// Serialize directly into the queue, unless the command would wrap
+			// around the end of the buffer.
+			alignas(ipc::Command) unsigned char staging[MAX_INLINE_COMMAND_SIZE];
+			ipc::Queue *queue = send_queue(priority);
+			void *buf = ipc::queue_reserve(queue, queued_size);
+
+			if (spilled)
+				serialize_spilled_command(buf ? buf : staging, static_cast<const ipc::Command *>(spilled), pointer_to_offset(spilled));
+			else
+				command.serialize(buf ? buf : staging);
+
+			if (buf)
+				ipc::queue_commit(queue, queued_size);
+			else
+				ipc::queue_write(queue, staging, queued_size);
 		}
 	} catch (...) {
-		command->deallocate_heap_resources(this);
-
-		if (transaction_id != INVALID_TRANSACTION) {
-			try {
-				std::lock_guard<std::mutex> lock{ m_worker_mutex };
-				m_callbacks.erase(transaction_id);
-			} catch (...) {
-				std::terminate();
-			}
-		}
+		if (spilled)
+			deallocate(spilled);
+		command.deallocate_heap_resources(this);
+
+		if (transaction_id != INVALID_TRANSACTION)
+			m_transactions.cancel(transaction_id);
 
 		throw IPCError{ std::current_exception(), "error sending command" };
 	}
 
 	// Command is visible to remote process. Heap can no longer be deallocated by client.
-	command->relinquish_heap_resources();
+	command.relinquish_heap_resources();
 
 	// Exception safety: command already in-flight. Communication errors are session-fatal.
 	try {
-		if (!::SetEvent(send_event()))
-			win32::trap_error("error setting event");
+		// Only wake the reader if it is blocked. Pairs with the fence in
+		// wait_recv_commands.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (send_queue(priority)->reader_waiting.load(std::memory_order_relaxed))
+			send_event().set();
+
+		// The receiver may have failed the pending callbacks before this one
+		// was registered.
+		if (transaction_id != INVALID_TRANSACTION && m_kill_flag) {
+			callback_type callback = m_transactions.take(transaction_id);
+			if (callback)
+				callback(nullptr);
+		}
 	} catch (...) {
 		ipc_log_current_exception();
 		stop();
@@ -516,32 +976,51 @@ void IPCClient::send_async(std::unique_ptr<Command> command, callback_type cb)
 	}
 }
 
-std::unique_ptr<Command> IPCClient::send_sync(std::unique_ptr<Command> command)
+IPCClient::QueueStats IPCClient::send_queue_stats(Priority priority) const
 {
-	std::condition_variable cond;
-	std::mutex mutex;
+	std::lock_guard<std::mutex> lock{ m_send_mutex[static_cast<int>(priority)] };
+	return m_send_stats[static_cast<int>(priority)];
+}
 
-	assert(std::this_thread::get_id() != m_recv_thread->get_id());
+std::unique_ptr<Command> IPCClient::send_sync(std::unique_ptr<Command> command, Priority priority)
+{
+	assert(std::this_thread::get_id() != m_recv_thread_id.load());
 	ipc_log("sync send command type: %d\n", command->type());
 
-	std::unique_ptr<Command> result;
-	bool called = false;
-
-	callback_type func = [&](std::unique_ptr<Command> c)
+	std::unique_ptr<SyncWaiter> waiter;
 	{
-		{
-			std::lock_guard<std::mutex> lock{ mutex };
-			result = std::move(c);
+		std::lock_guard<std::mutex> lock{ m_sync_waiter_mutex };
+		if (!m_sync_waiters.empty()) {
+			waiter = std::move(m_sync_waiters.back());
+			m_sync_waiters.pop_back();
 		}
-		called = true;
-		cond.notify_all();
-	};
+	}
+	if (!waiter)
+		waiter = std::make_unique<SyncWaiter>();
 
-	std::unique_lock<std::mutex> lock{ mutex };
-	send_async(std::move(command), std::move(func));
-	cond.wait(lock, [&]() { return called; });
+	SyncWaiter *w = waiter.get();
+	w->reset();
 
+	std::unique_ptr<Command> result;
+	try {
+		send_async(std::move(command), [w](std::unique_ptr<Command> c) { w->complete(std::move(c)); }, priority);
+		result = w->wait(m_spin_time);
+	} catch (...) {
+		std::lock_guard<std::mutex> lock{ m_sync_waiter_mutex };
+		m_sync_waiters.push_back(std::move(waiter));
+		throw;
+	}
+
+	std::lock_guard<std::mutex> lock{ m_sync_waiter_mutex };
+	m_sync_waiters.push_back(std::move(waiter));
 	return result;
 }
 
+Future<std::unique_ptr<Command>> IPCClient::send_request(std::unique_ptr<Command> command, Priority priority)
+{
+	auto state = std::make_shared<Future<std::unique_ptr<Command>>::state_type>();
+	send_async(std::move(command), [state](std::unique_ptr<Command> c) { state->set_value(std::move(c)); }, priority);
+	return Future<std::unique_ptr<Command>>{ std::move(state) };
+}
+
 } // namespace ipc_client
@@ -10,13 +10,20 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
-#include <unordered_map>
-#include "win32util.h"
+#include <vector>
+#include "frame_pool.h"
+#include "ipc_future.h"
+#include "platform.h"
+#include "transaction_table.h"
 
 namespace ipc {
 
+struct Command;
 struct Queue;
 struct Heap;
+struct HeapNode;
+struct HeapStats;
+struct VideoFrame;
 
 } // namespace ipc
 
@@ -24,6 +31,51 @@ struct Heap;
 namespace ipc_client {
 
 class Command;
+class CommandView;
+
+// Limits on the size of each command queue and heap. The heaps are reserved
+// in full, but only committed as they are used.
+constexpr uint32_t MIN_QUEUE_SIZE = 4096;
+constexpr uint32_t MAX_QUEUE_SIZE = 1UL << 20;
+constexpr uint32_t DEFAULT_QUEUE_SIZE = 4096;
+
+// Size of each urgent command queue. Only small control commands are expected.
+constexpr uint32_t URGENT_QUEUE_SIZE = 4096;
+
+// Commands larger than this are placed in the sender's heap, and only a small
+// descriptor is sent through the queue.
+constexpr uint32_t MAX_INLINE_COMMAND_SIZE = 1024;
+static_assert(MAX_INLINE_COMMAND_SIZE < URGENT_QUEUE_SIZE && MAX_INLINE_COMMAND_SIZE < MIN_QUEUE_SIZE, "command must fit in queue");
+
+// The whole shared memory section is mapped as a single view, which must fit
+// in the address space of a 32-bit slave. The limit leaves room for rounding
+// up to large pages.
+constexpr uint32_t MAX_SHMEM_SIZE = 1536 * (1UL << 20);
+
+constexpr uint32_t MIN_HEAP_SIZE = 1UL << 20;
+constexpr uint32_t MAX_HEAP_SIZE = 736 * (1UL << 20);
+// Default size of each heap, for strings, spilled commands and a few frames.
+// Callers that know how many frames will be in flight add room for them.
+constexpr uint32_t DEFAULT_HEAP_SIZE = 64 * (1UL << 20);
+static_assert(MAX_QUEUE_SIZE * 2 + URGENT_QUEUE_SIZE * 2 + MAX_HEAP_SIZE * 2 + (32UL << 20) <= MAX_SHMEM_SIZE, "shared memory too large");
+
+// Time in milliseconds that a sender waits for space in a full command queue
+// before the send fails.
+constexpr uint32_t DEFAULT_SEND_TIMEOUT = 30000;
+
+// Time in microseconds that the receiver polls an empty queue before blocking.
+constexpr uint32_t DEFAULT_SPIN_TIME = 50;
+
+// Number of local frees batched before the heap is locked to process them.
+constexpr uint32_t DEFAULT_DEFERRED_FREE_THRESHOLD = 32;
+
+// Urgent commands are sent through a separate queue that the receiver drains
+// first, so they are not delayed behind a backlog of regular commands. Commands
+// in different queues may be received out of order.
+enum class Priority {
+	NORMAL,
+	URGENT,
+};
 
 class IPCError : public std::runtime_error {
 	std::exception_ptr m_cause;
@@ -58,62 +110,147 @@ class IPCClient {
 public:
 	// Called from the receiver thread. Throwing exceptions will terminate the
 	// session. The parameter will be null if the response could not be
-	// deserialized or the session ended.
-	typedef std::function<void(std::unique_ptr<Command>)> callback_type;
+	// deserialized or the session ended. Small callables are stored without
+	// allocating.
+	typedef Callback callback_type;
+
+	// Called from the receiver thread with each command that is not a response
+	// to a pending transaction, before it is deserialized. Returns true if the
+	// command was handled in place, or false to pass it to the default callback.
+	// The view is only valid during the call.
+	typedef std::function<bool(const CommandView &)> view_callback_type;
+
+	// Time senders spent waiting for space in the send queue.
+	struct QueueStats {
+		uint64_t stalls;
+		uint64_t timeouts;
+		uint64_t stall_time_us;
+		uint64_t max_stall_us;
+	};
 private:
 	struct master_tag {};
 	struct slave_tag {};
 
 	// IPC control structures.
-	win32::unique_handle m_shmem_handle;
-	win32::unique_file_view m_shmem;
+	platform::SharedMemory m_shmem;
 
 	ipc::Queue *m_master_queue;
-	win32::unique_handle m_master_event;
-	win32::unique_handle m_master_mutex;
+	ipc::Queue *m_master_urgent_queue;
+	platform::Event m_master_event;
+	platform::Event m_master_space_event;
+	platform::Event m_master_urgent_space_event;
 
 	ipc::Queue *m_slave_queue;
-	win32::unique_handle m_slave_event;
-	win32::unique_handle m_slave_mutex;
-
-	ipc::Heap *m_heap;
-	win32::unique_handle m_heap_mutex;
-
-	win32::detail::HANDLE m_remote_process;
+	ipc::Queue *m_slave_urgent_queue;
+	platform::Event m_slave_event;
+	platform::Event m_slave_space_event;
+	platform::Event m_slave_urgent_space_event;
+
+	// Serializes writers to each send queue within this process, and protects
+	// the send statistics. Indexed by priority.
+	mutable std::mutex m_send_mutex[2];
+	QueueStats m_send_stats[2];
+	uint32_t m_send_timeout;
+	uint32_t m_spin_time;
+
+	ipc::Heap *m_master_heap;
+	ipc::Heap *m_slave_heap;
+	mutable std::mutex m_heap_mutex;
+	FramePool m_frame_pool;
+	std::atomic_uint32_t m_deferred_frees;
+	uint32_t m_deferred_free_threshold;
+
+	platform::Process m_remote_process;
 	bool m_master;
 
 	// Transaction state.
-	std::unordered_map<uint32_t, callback_type> m_callbacks;
+	TransactionTable m_transactions;
 	callback_type m_default_cb;
+	view_callback_type m_view_cb;
 	std::mutex m_worker_mutex;
-	std::atomic_uint32_t m_transaction_id;
 	std::atomic_bool m_kill_flag;
 
 	std::unique_ptr<std::thread> m_recv_thread;
+	std::atomic<std::thread::id> m_recv_thread_id;
 	std::exception_ptr m_recv_exception;
 
-	ipc::Queue *send_queue() const { return m_master ? m_master_queue : m_slave_queue; }
-	win32::detail::HANDLE send_event() const { return m_master ? m_master_event.get().h : m_slave_event.get().h; }
-	win32::detail::HANDLE send_mutex() const { return m_master ? m_master_mutex.get().h : m_slave_mutex.get().h; }
+	// Idle waiters for synchronous sends. A waiter is completed directly by
+	// the receiver thread, and is reused by later calls.
+	class SyncWaiter;
+	std::vector<std::unique_ptr<SyncWaiter>> m_sync_waiters;
+	std::mutex m_sync_waiter_mutex;
+
+	ipc::Queue *master_queue(Priority priority) const { return priority == Priority::URGENT ? m_master_urgent_queue : m_master_queue; }
+	ipc::Queue *slave_queue(Priority priority) const { return priority == Priority::URGENT ? m_slave_urgent_queue : m_slave_queue; }
+	const platform::Event &master_space_event(Priority priority) const { return priority == Priority::URGENT ? m_master_urgent_space_event : m_master_space_event; }
+	const platform::Event &slave_space_event(Priority priority) const { return priority == Priority::URGENT ? m_slave_urgent_space_event : m_slave_space_event; }
+
+	ipc::Queue *send_queue(Priority priority) const { return m_master ? master_queue(priority) : slave_queue(priority); }
+	const platform::Event &send_event() const { return m_master ? m_master_event : m_slave_event; }
+	const platform::Event &send_space_event(Priority priority) const { return m_master ? master_space_event(priority) : slave_space_event(priority); }
+
+	ipc::Queue *recv_queue(Priority priority) const { return m_master ? slave_queue(priority) : master_queue(priority); }
+	const platform::Event &recv_event() const { return m_master ? m_slave_event : m_master_event; }
+	const platform::Event &recv_space_event(Priority priority) const { return m_master ? slave_space_event(priority) : master_space_event(priority); }
+
+	// Heap from which this process allocates.
+	ipc::Heap *local_heap() const { return m_master ? m_master_heap : m_slave_heap; }
+	ipc::Heap *remote_heap() const { return m_master ? m_slave_heap : m_master_heap; }
 
-	ipc::Queue *recv_queue() const { return m_master ? m_slave_queue : m_master_queue; }
-	win32::detail::HANDLE recv_event() const { return m_master ? m_slave_event.get().h : m_master_event.get().h; }
-	win32::detail::HANDLE recv_mutex() const { return m_master ? m_slave_mutex.get().h : m_master_mutex.get().h; }
+	// Heap containing the pointer, or null if not in any heap.
+	ipc::Heap *find_heap(const void *ptr) const;
+
+	ipc::HeapStats heap_stats(ipc::Heap *heap) const;
+
+	// Free the blocks returned by the other process, keeping frame buffers in
+	// the pool. The caller must be holding the heap lock.
+	void drain_remote(ipc::Heap *heap);
+	static bool recycle_frame(void *opaque, ipc::Heap *heap, ipc::HeapNode *node);
 
 	explicit IPCClient(bool master);
 
-	uint32_t next_transaction_id();
+	ipc::HeapNode *pointer_to_node(void *ptr) const;
+
+	// Return a block to the heap that contains it. If the block is in the local
+	// heap, the caller must be holding the heap mutex.
+	void free_node(void *ptr);
+
+	// Fault in the first (size) committed bytes of both heaps, and optionally
+	// lock them into the working set.
+	void warm_up_heaps(uint32_t size, bool lock);
+
+	// Free a block after its last reference was dropped, batching local frees.
+	void reclaim_node(ipc::HeapNode *node);
+
+	// Wait until the send queue has room for (size) bytes. The caller must be
+	// holding the send mutex of the queue.
+	void wait_send_space(Priority priority, uint32_t size);
+
+	// Wait until either receive queue has commands or the client is stopped.
+	// Polls the queues before blocking.
+	void wait_recv_commands();
+
+	// Consume a command from a receive queue and wake a waiting writer.
+	void release_recv_space(Priority priority, uint32_t size);
+
+	// Locate the command referred to by a spilled command descriptor.
+	void *find_spilled_command(const ipc::Command *descriptor) const;
 
 	void recv_thread_func();
 public:
 	static master_tag master() { return{}; }
 	static slave_tag slave() { return{}; }
 
-	// Allocate IPC context and start slave process.
-	IPCClient(master_tag, const wchar_t *slave_path);
+	// Allocate IPC context and start slave process. The master and slave each
+	// get a heap and a command queue of the given sizes. Large pages are used
+	// for the shared memory if requested and available. The first
+	// (warm_up_size) bytes of each heap are committed and faulted in by both
+	// processes up front, and locked into memory if requested.
+	IPCClient(master_tag, const platform::path_char *slave_path, uint32_t heap_size = DEFAULT_HEAP_SIZE, uint32_t queue_size = DEFAULT_QUEUE_SIZE,
+	          bool large_pages = false, uint32_t warm_up_size = 0, bool lock_memory = false);
 
-	// Connect to master process.
-	IPCClient(slave_tag, win32::detail::HANDLE master_process, win32::detail::HANDLE shmem_handle, size_t shmem_size);
+	// Connect to master process. Takes ownership of the shared memory handle.
+	IPCClient(slave_tag, platform::native_handle master_process, platform::native_handle shmem_handle, size_t shmem_size);
 
 	IPCClient(const IPCClient &) = delete;
 	IPCClient(IPCClient &&) = delete;
@@ -124,26 +261,79 @@ public:
 	IPCClient &operator=(IPCClient &&) = delete;
 
 	// Begin receiving commands. The client can only be started once.
-	void start(callback_type default_cb);
+	void start(callback_type default_cb, view_callback_type view_cb = nullptr);
 
 	// Stop receiving commands. If a fatal communication error had previously
 	// occurred, any exception generated will be raised here.
 	void stop();
 
-	// Heap interface.
+	// Heap interface. Blocks are allocated from the heap owned by the calling
+	// process, but can be deallocated by either process.
 	uint32_t pointer_to_offset(void *ptr) const;
 	void *offset_to_pointer(uint32_t off) const;
 
 	void *allocate(size_t size);
 	void deallocate(void *ptr);
 
+	// Reference counting. Blocks are allocated with one reference, and
+	// deallocate drops a reference. The block is freed once both processes
+	// have dropped all their references.
+	void retain(void *ptr);
+
+	// Allocate a block aligned to the given power of two, at least 64.
+	void *allocate_aligned(size_t size, uint32_t alignment);
+
+	// Batch frees of local blocks until the given number are pending or the
+	// next allocation. Zero frees blocks immediately.
+	void set_deferred_free_threshold(uint32_t threshold) { m_deferred_free_threshold = threshold; }
+
+	// Allocate a page-aligned buffer for the layout given by the strides and
+	// heights of the frame, preferring a recycled buffer of about the same size.
+	// Sets the heap offset of the frame and returns the buffer.
+	void *allocate_frame(ipc::VideoFrame *frame);
+
+	// Drop a reference to the buffer of a frame. The last reference returns
+	// the buffer to the pool for reuse if possible.
+	void deallocate_frame(const ipc::VideoFrame &frame);
+
+	FramePool::Stats frame_pool_stats() const { return m_frame_pool.stats(); }
+
+	// Senders wait up to the given number of milliseconds for space in a full
+	// send queue. The queue size is set when the master is created.
+	void set_send_timeout(uint32_t timeout) { m_send_timeout = timeout; }
+
+	// The receiver polls for the given number of microseconds before blocking,
+	// sparing the sender a kernel call if a command follows shortly. Zero
+	// always blocks, as on single-processor systems. Must be set before the
+	// client is started.
+	void set_spin_time(uint32_t spin_time) { m_spin_time = spin_time; }
+
+	QueueStats send_queue_stats(Priority priority = Priority::NORMAL) const;
+
+	// Allocation statistics of the master and slave heaps. Locks the local heap
+	// to update its largest free block; that of the remote heap is as of the
+	// other process's last query.
+	ipc::HeapStats master_heap_stats() const;
+	ipc::HeapStats slave_heap_stats() const;
+
 	// Send a command with an optional callback. The callback will be invoked
-	// from the command receiver thread. Raises any prior exceptions.
-	void send_async(std::unique_ptr<Command> command, callback_type cb = nullptr);
+	// from the command receiver thread, or with null from the calling thread
+	// if the session has ended, so the caller must not hold a lock that the
+	// callback takes. Raises any prior exceptions.
+	void send_async(std::unique_ptr<Command> command, callback_type cb = nullptr, Priority priority = Priority::NORMAL);
+
+	// Send a command owned by the caller, such as one on the stack. Its heap
+	// resources are relinquished once sent, or deallocated if the send fails.
+	void send_async(Command &command, callback_type cb = nullptr, Priority priority = Priority::NORMAL);
 
 	// Send a command and wait for the result. Synchronous commands can not be
 	// sent from the command receiver thread. Raises any prior exceptions.
-	std::unique_ptr<Command> send_sync(std::unique_ptr<Command> command);
+	std::unique_ptr<Command> send_sync(std::unique_ptr<Command> command, Priority priority = Priority::NORMAL);
+
+	// Send a command and return a future of the result, which is null if the
+	// session ended. The caller owns the heap resources of the result. Raises
+	// any prior exceptions.
+	Future<std::unique_ptr<Command>> send_request(std::unique_ptr<Command> command, Priority priority = Priority::NORMAL);
 };
 
 } // namespace ipc_client
@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include "ipc_client.h"
 #include "ipc_commands.h"
 #include "ipc_types.h"
@@ -64,6 +65,25 @@ std::unique_ptr<Derived> Command_Args1_pod<Type, T>::deserialize_internal(const
 }
 
 
+template <CommandType Type, class T>
+template <class Derived>
+std::unique_ptr<Derived> Command_Args1_array<Type, T>::deserialize_internal(const void *buf, size_t size)
+{
+	uint32_t count;
+	if (size < sizeof(count))
+		throw_deserialization_error("buffer overrun");
+
+	std::memcpy(&count, buf, sizeof(count));
+	if (count > (size - sizeof(count)) / sizeof(T))
+		throw_deserialization_error("buffer overrun");
+
+	std::vector<T> arg(count);
+	if (count)
+		std::memcpy(arg.data(), static_cast<const unsigned char *>(buf) + sizeof(count), count * sizeof(T));
+	return std::make_unique<Derived>(std::move(arg));
+}
+
+
 std::unique_ptr<CommandSetScriptVar> CommandSetScriptVar::deserialize_internal(const void *buf, size_t size)
 {
 	size_t len = ipc::deserialize_str(nullptr, buf, size);
@@ -91,7 +111,7 @@ std::unique_ptr<CommandSetScriptVar> CommandSetScriptVar::deserialize_internal(c
 CommandSetScriptVar::~CommandSetScriptVar()
 {
 	if (m_value.type == ipc::Value::STRING && m_value.s != ipc::NULL_OFFSET)
-		ipc_log("leaking heap allocation at %u", m_value.s);
+		ipc_log("leaking heap allocation at %u\n", m_value.s);
 }
 
 size_t CommandSetScriptVar::size_internal() const noexcept
@@ -129,7 +149,7 @@ void CommandSetScriptVar::relinquish_heap_resources() noexcept
 CommandEvalScript::~CommandEvalScript()
 {
 	if (m_arg != ipc::NULL_OFFSET)
-		ipc_log("leaking heap allocation at %u", m_arg);
+		ipc_log("leaking heap allocation at %u\n", m_arg);
 }
 
 void CommandEvalScript::deallocate_heap_resources(IPCClient *client)
@@ -147,12 +167,12 @@ void CommandEvalScript::relinquish_heap_resources() noexcept
 CommandSetFrame::~CommandSetFrame()
 {
 	if (m_arg.heap_offset != ipc::NULL_OFFSET)
-		ipc_log("leaking heap allocation at %u", m_arg.heap_offset);
+		ipc_log("leaking heap allocation at %u\n", m_arg.heap_offset);
 }
 
 void CommandSetFrame::deallocate_heap_resources(IPCClient *client)
 {
-	client->deallocate(client->offset_to_pointer(m_arg.heap_offset));
+	client->deallocate_frame(m_arg);
 	m_arg.heap_offset = ipc::NULL_OFFSET;
 }
 
@@ -161,6 +181,30 @@ void CommandSetFrame::relinquish_heap_resources() noexcept
 	m_arg.heap_offset = ipc::NULL_OFFSET;
 }
 
+
+CommandSetFrames::~CommandSetFrames()
+{
+	for (const ipc::VideoFrame &frame : m_arg) {
+		if (frame.heap_offset != ipc::NULL_OFFSET)
+			ipc_log("leaking heap allocation at %u\n", frame.heap_offset);
+	}
+}
+
+void CommandSetFrames::deallocate_heap_resources(IPCClient *client)
+{
+	for (ipc::VideoFrame &frame : m_arg) {
+		client->deallocate_frame(frame);
+		frame.heap_offset = ipc::NULL_OFFSET;
+	}
+}
+
+void CommandSetFrames::relinquish_heap_resources() noexcept
+{
+	for (ipc::VideoFrame &frame : m_arg) {
+		frame.heap_offset = ipc::NULL_OFFSET;
+	}
+}
+
 } // namespace detail
 
 
@@ -173,9 +217,12 @@ void Command::deserialize_common(const ipc::Command *command)
 size_t Command::serialized_size() const noexcept
 {
 	size_t internal_size = size_internal();
-	assert(internal_size <= UINT32_MAX);
+	assert(internal_size <= UINT32_MAX - sizeof(ipc::Command) - alignof(ipc::Command));
 	size_t size = sizeof(ipc::Command) + internal_size;
-	assert(size <= UINT32_MAX);
+
+	// Pad the payload so that the next command in the queue is aligned.
+	if (size % alignof(ipc::Command))
+		size += alignof(ipc::Command) - size % alignof(ipc::Command);
 	return size;
 }
 
@@ -187,8 +234,10 @@ void Command::serialize(void *buf) const noexcept
 	command->response_id = response_id();
 	command->type = static_cast<int32_t>(type());
 
-	void *payload = ipc::offset_to_pointer<void>(command, sizeof(ipc::Command));
+	size_t internal_size = size_internal();
+	unsigned char *payload = ipc::offset_to_pointer<unsigned char>(command, sizeof(ipc::Command));
 	serialize_internal(payload);
+	std::memset(payload + internal_size, 0, command->size - sizeof(ipc::Command) - internal_size);
 }
 
 
@@ -205,36 +254,9 @@ std::unique_ptr<Command> deserialize_command(const ipc::Command *command)
 	std::unique_ptr<Command> deserialized;
 
 	switch (static_cast<CommandType>(command->type)) {
-	case CommandType::ACK:
-		deserialized = std::make_unique<CommandAck>();
-		break;
-	case CommandType::ERR:
-		deserialized = std::make_unique<CommandErr>();
-		break;
-	case CommandType::SET_LOG_FILE:
-		deserialized = CommandSetLogFile::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::LOAD_AVISYNTH:
-		deserialized = CommandLoadAvisynth::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::NEW_SCRIPT_ENV:
-		deserialized = std::make_unique<CommandNewScriptEnv>();
-		break;
-	case CommandType::GET_SCRIPT_VAR:
-		deserialized = CommandGetScriptVar::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::SET_SCRIPT_VAR:
-		deserialized = CommandSetScriptVar::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::EVAL_SCRIPT:
-		deserialized = CommandEvalScript::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::GET_FRAME:
-		deserialized = CommandGetFrame::deserialize_internal(payload, payload_size);
-		break;
-	case CommandType::SET_FRAME:
-		deserialized = CommandSetFrame::deserialize_internal(payload, payload_size);
-		break;
+#define X(id, name, impl) case CommandType::id: deserialized = name::deserialize_internal(payload, payload_size); break;
+	IPC_COMMAND_TABLE(X)
+#undef X
 	default:
 		break;
 	}
@@ -246,29 +268,50 @@ std::unique_ptr<Command> deserialize_command(const ipc::Command *command)
 }
 
 
+uint32_t CommandView::transaction_id() const { return m_command->transaction_id; }
+uint32_t CommandView::response_id() const { return m_command->response_id; }
+CommandType CommandView::type() const { return static_cast<CommandType>(m_command->type); }
+
+const void *CommandView::payload() const { return ipc::offset_to_pointer<const void>(m_command, sizeof(ipc::Command)); }
+size_t CommandView::payload_size() const { return m_command->size - sizeof(ipc::Command); }
+
+
+bool read_frame_requests(const CommandView &view, FrameRequests *requests)
+{
+	requests->type = view.type();
+	requests->transaction_id = view.transaction_id();
+
+	if (view.type() == CommandType::GET_FRAME) {
+		if (!view.pod_arg(&requests->requests[0]))
+			detail::throw_deserialization_error("buffer overrun");
+
+		requests->count = 1;
+		return true;
+	}
+
+	if (view.type() != CommandType::GET_FRAMES)
+		return false;
+
+	uint32_t count;
+	if (!view.pod_arg(&count))
+		detail::throw_deserialization_error("buffer overrun");
+	if (!count || count > MAX_FRAME_BATCH)
+		return false;
+	if (count > (view.payload_size() - sizeof(count)) / sizeof(ipc::VideoFrameRequest))
+		detail::throw_deserialization_error("buffer overrun");
+
+	std::memcpy(requests->requests, static_cast<const unsigned char *>(view.payload()) + sizeof(count), count * sizeof(ipc::VideoFrameRequest));
+	requests->count = count;
+	return true;
+}
+
+
 int CommandObserver::dispatch(std::unique_ptr<Command> c)
 {
 	switch (c->type()) {
-	case CommandType::ACK:
-		return observe(unique_ptr_cast<CommandAck>(std::move(c)));
-	case CommandType::ERR:
-		return observe(unique_ptr_cast<CommandErr>(std::move(c)));
-	case CommandType::SET_LOG_FILE:
-		return observe(unique_ptr_cast<CommandSetLogFile>(std::move(c)));
-	case CommandType::LOAD_AVISYNTH:
-		return observe(unique_ptr_cast<CommandLoadAvisynth>(std::move(c)));
-	case CommandType::NEW_SCRIPT_ENV:
-		return observe(unique_ptr_cast<CommandNewScriptEnv>(std::move(c)));
-	case CommandType::GET_SCRIPT_VAR:
-		return observe(unique_ptr_cast<CommandGetScriptVar>(std::move(c)));
-	case CommandType::SET_SCRIPT_VAR:
-		return observe(unique_ptr_cast<CommandSetScriptVar>(std::move(c)));
-	case CommandType::EVAL_SCRIPT:
-		return observe(unique_ptr_cast<CommandEvalScript>(std::move(c)));
-	case CommandType::GET_FRAME:
-		return observe(unique_ptr_cast<CommandGetFrame>(std::move(c)));
-	case CommandType::SET_FRAME:
-		return observe(unique_ptr_cast<CommandSetFrame>(std::move(c)));
+#define X(id, name, impl) case CommandType::id: return observe(unique_ptr_cast<name>(std::move(c)));
+	IPC_COMMAND_TABLE(X)
+#undef X
 	default:
 		return 0;
 	}
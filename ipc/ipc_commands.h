@@ -5,8 +5,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <vector>
 #include "video_types.h"
 
 namespace ipc {
@@ -21,17 +23,28 @@ constexpr uint32_t INVALID_TRANSACTION = ~static_cast<uint32_t>(0);
 class IPCClient;
 class IPCError;
 
+// The command set. Each entry is the command type, the name of the command
+// class and its implementation. The type, class, observer and
+// (de)serialization dispatch are generated from this table. New commands are
+// appended, since the order defines the protocol.
+#define IPC_COMMAND_TABLE(X) \
+	X(ACK,            CommandAck,          detail::Command_Args0<CommandType::ACK>) \
+	X(ERR,            CommandErr,          detail::Command_Args0<CommandType::ERR>) \
+	X(SET_LOG_FILE,   CommandSetLogFile,   detail::Command_Args1_wstr<CommandType::SET_LOG_FILE>) \
+	X(LOAD_AVISYNTH,  CommandLoadAvisynth, detail::Command_Args1_wstr<CommandType::LOAD_AVISYNTH>) \
+	X(NEW_SCRIPT_ENV, CommandNewScriptEnv, detail::Command_Args0<CommandType::NEW_SCRIPT_ENV>) \
+	X(GET_SCRIPT_VAR, CommandGetScriptVar, detail::Command_Args1_str<CommandType::GET_SCRIPT_VAR>) \
+	X(SET_SCRIPT_VAR, CommandSetScriptVar, detail::CommandSetScriptVar) \
+	X(EVAL_SCRIPT,    CommandEvalScript,   detail::CommandEvalScript) \
+	X(GET_FRAME,      CommandGetFrame,     detail::CommandGetFrame) \
+	X(SET_FRAME,      CommandSetFrame,     detail::CommandSetFrame) \
+	X(GET_FRAMES,     CommandGetFrames,    detail::CommandGetFrames) \
+	X(SET_FRAMES,     CommandSetFrames,    detail::CommandSetFrames)
+
 enum class CommandType : int32_t {
-	ACK,
-	ERR,
-	SET_LOG_FILE,
-	LOAD_AVISYNTH,
-	NEW_SCRIPT_ENV,
-	GET_SCRIPT_VAR,
-	SET_SCRIPT_VAR,
-	EVAL_SCRIPT,
-	GET_FRAME,
-	SET_FRAME,
+#define X(id, name, impl) id,
+	IPC_COMMAND_TABLE(X)
+#undef X
 };
 
 class Command {
@@ -75,6 +88,36 @@ public:
 
 std::unique_ptr<Command> deserialize_command(const ipc::Command *command);
 
+// Non-owning view of a serialized command, parsed in place in the receive
+// queue. Only valid for the duration of the receive callback.
+class CommandView {
+	const ipc::Command *m_command;
+public:
+	explicit CommandView(const ipc::Command *command) : m_command{ command } {}
+
+	uint32_t transaction_id() const;
+	uint32_t response_id() const;
+	CommandType type() const;
+
+	const void *payload() const;
+	size_t payload_size() const;
+
+	// Copy the argument of a command with a single POD argument. Returns false
+	// if the payload is too small.
+	template <class T>
+	bool pod_arg(T *arg) const
+	{
+		if (payload_size() < sizeof(T))
+			return false;
+		std::memcpy(arg, payload(), sizeof(T));
+		return true;
+	}
+
+	// Deserialize an owned copy of the command, or null if the type is unknown.
+	std::unique_ptr<Command> materialize() const { return deserialize_command(m_command); }
+
+};
+
 
 namespace detail {
 
@@ -82,8 +125,12 @@ namespace detail {
 
 template <CommandType Type>
 class Command_Args0 : public Command {
+protected:
+	static std::unique_ptr<Command_Args0> deserialize_internal(const void *buf, size_t size) { return std::make_unique<Command_Args0>(); }
 public:
 	Command_Args0() : Command{ Type } {}
+
+	friend std::unique_ptr<Command> (::ipc_client::deserialize_command)(const ipc::Command *command);
 };
 
 template <CommandType Type>
@@ -140,6 +187,30 @@ public:
 	friend std::unique_ptr<Command> (::ipc_client::deserialize_command)(const ipc::Command *command);
 };
 
+template <CommandType Type, class T>
+class Command_Args1_array : public Command {
+protected:
+	std::vector<T> m_arg;
+
+	template <class Derived = Command_Args1_array>
+	static std::unique_ptr<Derived> deserialize_internal(const void *buf, size_t size);
+
+	size_t size_internal() const noexcept override { return sizeof(uint32_t) + m_arg.size() * sizeof(T); }
+	void serialize_internal(void *buf) const noexcept override
+	{
+		uint32_t count = static_cast<uint32_t>(m_arg.size());
+		std::memcpy(buf, &count, sizeof(count));
+		if (count)
+			std::memcpy(static_cast<unsigned char *>(buf) + sizeof(count), m_arg.data(), m_arg.size() * sizeof(T));
+	}
+public:
+	explicit Command_Args1_array(std::vector<T> arg) : Command{ Type }, m_arg(std::move(arg)) {}
+
+	const std::vector<T> &arg() const { return m_arg; }
+
+	friend std::unique_ptr<Command> (::ipc_client::deserialize_command)(const ipc::Command *command);
+};
+
 class CommandSetScriptVar : public Command {
 	std::string m_name;
 	ipc::Value m_value;
@@ -183,6 +254,8 @@ public:
 	friend std::unique_ptr<Command>(::ipc_client::deserialize_command)(const ipc::Command *command);
 };
 
+typedef Command_Args1_pod<CommandType::GET_FRAME, ipc::VideoFrameRequest> CommandGetFrame;
+
 class CommandSetFrame : public Command_Args1_pod<CommandType::SET_FRAME, ipc::VideoFrame> {
 protected:
 	static std::unique_ptr<CommandSetFrame> deserialize_internal(const void *buf, size_t size)
@@ -200,32 +273,80 @@ public:
 	friend std::unique_ptr<Command>(::ipc_client::deserialize_command)(const ipc::Command *command);
 };
 
+typedef Command_Args1_array<CommandType::GET_FRAMES, ipc::VideoFrameRequest> CommandGetFrames;
+
+class CommandSetFrames : public Command_Args1_array<CommandType::SET_FRAMES, ipc::VideoFrame> {
+protected:
+	static std::unique_ptr<CommandSetFrames> deserialize_internal(const void *buf, size_t size)
+	{
+		return Command_Args1_array::deserialize_internal<CommandSetFrames>(buf, size);
+	}
+public:
+	using Command_Args1_array::Command_Args1_array;
+
+	~CommandSetFrames() override;
+
+	void deallocate_heap_resources(IPCClient *client) override;
+	void relinquish_heap_resources() noexcept override;
+
+	friend std::unique_ptr<Command>(::ipc_client::deserialize_command)(const ipc::Command *command);
+};
+
 } // namespace detail
 
 
-typedef detail::Command_Args0<CommandType::ACK> CommandAck;
-typedef detail::Command_Args0<CommandType::ERR> CommandErr;
-typedef detail::Command_Args1_wstr<CommandType::SET_LOG_FILE> CommandSetLogFile;
-typedef detail::Command_Args1_wstr<CommandType::LOAD_AVISYNTH> CommandLoadAvisynth;
-typedef detail::Command_Args0<CommandType::NEW_SCRIPT_ENV> CommandNewScriptEnv;
-typedef detail::Command_Args1_str<CommandType::GET_SCRIPT_VAR> CommandGetScriptVar;
-typedef detail::CommandSetScriptVar CommandSetScriptVar;
-typedef detail::CommandEvalScript CommandEvalScript;
-typedef detail::Command_Args1_pod<CommandType::GET_FRAME, ipc::VideoFrameRequest> CommandGetFrame;
-typedef detail::CommandSetFrame CommandSetFrame;
+#define X(id, name, impl) typedef impl name;
+IPC_COMMAND_TABLE(X)
+#undef X
+
+// Frames are requested in batches of up to this many, to amortize the cost of
+// a round trip over runs of consecutive frames.
+constexpr uint32_t MAX_FRAME_BATCH = 16;
+
+// Number of frames to request at once, starting at a missing frame. The batch
+// grows while the missing frames follow on from the previous batch, and is
+// reset by a seek.
+class FrameBatchSize {
+	int32_t m_next;
+	uint32_t m_size;
+public:
+	FrameBatchSize() : m_next{ -1 }, m_size{} {}
+
+	uint32_t next(int32_t n, uint32_t max_size)
+	{
+		m_size = n == m_next && m_size ? m_size * 2 : 1;
+		m_size = m_size < max_size ? m_size : (max_size ? max_size : 1);
+		m_next = n + static_cast<int32_t>(m_size);
+		return m_size;
+	}
+
+	// Start again from a single frame, such as after a batch failed.
+	void reset()
+	{
+		m_next = -1;
+		m_size = 0;
+	}
+};
+
+// Frames requested by a GET_FRAME or GET_FRAMES command, copied out of a
+// CommandView so that the request can be queued without allocating.
+struct FrameRequests {
+	CommandType type;
+	uint32_t transaction_id;
+	uint32_t count;
+	ipc::VideoFrameRequest requests[MAX_FRAME_BATCH];
+};
+
+// Copy the requests of a GET_FRAME or GET_FRAMES command. Returns false for
+// other commands, and for empty batches or batches of more than
+// MAX_FRAME_BATCH frames.
+bool read_frame_requests(const CommandView &view, FrameRequests *requests);
 
 class CommandObserver {
 protected:
-	virtual int observe(std::unique_ptr<CommandAck> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandErr> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandSetLogFile> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandLoadAvisynth> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandNewScriptEnv> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandGetScriptVar> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandSetScriptVar> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandEvalScript> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandGetFrame> c) { return 0; }
-	virtual int observe(std::unique_ptr<CommandSetFrame> c) { return 0; }
+#define X(id, name, impl) virtual int observe(std::unique_ptr<name> c) { return 0; }
+	IPC_COMMAND_TABLE(X)
+#undef X
 public:
 	int dispatch(std::unique_ptr<Command> c);
 };
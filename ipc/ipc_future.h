@@ -0,0 +1,196 @@
+#pragma once
+
+#ifndef IPC_FUTURE_H_
+#define IPC_FUTURE_H_
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+  #define IPC_COROUTINES 1
+  #include <coroutine>
+#endif
+
+namespace ipc_client {
+
+template <class T>
+class Future;
+
+template <class T>
+Future<std::vector<T>> when_all(std::vector<Future<T>> futures);
+
+namespace detail {
+
+// Result shared between a future and the thread that completes it.
+template <class T>
+class FutureState {
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::function<void()> m_continuation;
+	T m_value;
+	bool m_ready;
+public:
+	FutureState() : m_value{}, m_ready{} {}
+
+	FutureState(const FutureState &) = delete;
+	FutureState &operator=(const FutureState &) = delete;
+
+	void set_value(T value)
+	{
+		std::function<void()> continuation;
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_value = std::move(value);
+			m_ready = true;
+			continuation = std::move(m_continuation);
+		}
+		m_cond.notify_all();
+
+		if (continuation)
+			continuation();
+	}
+
+	bool ready()
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		return m_ready;
+	}
+
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		m_cond.wait(lock, [&]() { return m_ready; });
+	}
+
+	bool wait_for(std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		return m_cond.wait_for(lock, timeout, [&]() { return m_ready; });
+	}
+
+	T take()
+	{
+		std::unique_lock<std::mutex> lock{ m_mutex };
+		m_cond.wait(lock, [&]() { return m_ready; });
+		return std::move(m_value);
+	}
+
+	// Run (f) from the completing thread. Returns false without storing it if
+	// the value is already set.
+	bool set_continuation(std::function<void()> f)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (m_ready)
+			return false;
+		m_continuation = std::move(f);
+		return true;
+	}
+};
+
+} // namespace detail
+
+
+// Result of an asynchronous request. The value can be polled, waited for, or
+// awaited from a C++20 coroutine. Awaiting coroutines are resumed on the
+// thread that completes the future, which for IPC requests is the command
+// receiver thread. A future can only be awaited or joined once, and get can
+// only be called once.
+template <class T>
+class Future {
+	std::shared_ptr<detail::FutureState<T>> m_state;
+
+	template <class U>
+	friend Future<std::vector<U>> when_all(std::vector<Future<U>> futures);
+public:
+	typedef detail::FutureState<T> state_type;
+
+	Future() = default;
+	explicit Future(std::shared_ptr<state_type> state) : m_state{ std::move(state) } {}
+
+	Future(Future &&) = default;
+	Future(const Future &) = delete;
+
+	Future &operator=(Future &&) = default;
+	Future &operator=(const Future &) = delete;
+
+	// A future is not valid once moved from or taken with get. Only valid
+	// futures can be waited for.
+	bool valid() const { return !!m_state; }
+	bool ready() const { assert(valid()); return m_state->ready(); }
+
+	void wait() const { assert(valid()); m_state->wait(); }
+
+	// Returns false if the value was not set within (timeout) milliseconds.
+	bool wait_for(uint32_t timeout) const { assert(valid()); return m_state->wait_for(std::chrono::milliseconds{ timeout }); }
+
+	// Wait for the value and take it. The future is no longer valid.
+	T get()
+	{
+		assert(valid());
+		std::shared_ptr<state_type> state = std::move(m_state);
+		return state->take();
+	}
+
+#ifdef IPC_COROUTINES
+	bool await_ready() const { return ready(); }
+	bool await_suspend(std::coroutine_handle<> h) { assert(valid()); return m_state->set_continuation([h]() { h.resume(); }); }
+	T await_resume() { return get(); }
+#endif
+};
+
+// Future of the values of all the given futures, in order. Completed by the
+// thread that completes the last of them.
+template <class T>
+Future<std::vector<T>> when_all(std::vector<Future<T>> futures)
+{
+	struct Join {
+		std::vector<Future<T>> futures;
+		std::shared_ptr<detail::FutureState<std::vector<T>>> state;
+		std::atomic_size_t remaining;
+	};
+
+	auto state = std::make_shared<detail::FutureState<std::vector<T>>>();
+	auto join = std::make_shared<Join>();
+	join->futures = std::move(futures);
+	join->state = state;
+	join->remaining = join->futures.size() + 1;
+
+	// Each future holds the join until it completes.
+	auto finish = [join]()
+	{
+		if (--join->remaining)
+			return;
+
+		std::vector<T> values;
+		values.reserve(join->futures.size());
+
+		for (Future<T> &future : join->futures) {
+			values.push_back(future.get());
+		}
+
+		join->futures.clear();
+		join->state->set_value(std::move(values));
+	};
+
+	for (Future<T> &future : join->futures) {
+		assert(future.valid());
+		if (!future.m_state->set_continuation(finish))
+			finish();
+	}
+	finish();
+
+	return Future<std::vector<T>>{ std::move(state) };
+}
+
+} // namespace ipc_client
+
+#endif // IPC_FUTURE_H_
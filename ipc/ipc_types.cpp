@@ -1,190 +1,972 @@
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <new>
 #include "ipc_types.h"
 
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
 namespace ipc {
 
 namespace {
 
-void split_heap_node(void *heap_base, HeapNode *node, uint32_t size)
+// Index of the most significant set bit. The argument must be non-zero.
+uint32_t bit_scan_reverse(uint32_t x)
 {
-	uint32_t node_offset = pointer_to_offset(heap_base, node);
-	uint32_t alloc_size = size;
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, x);
+	return index;
+#else
+	return 31 - __builtin_clz(x);
+#endif
+}
+
+// Index of the least significant set bit. The argument must be non-zero.
+uint32_t bit_scan_forward(uint32_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+uint32_t heap_capacity(const Heap *heap)
+{
+	return heap->size - heap->buffer_offset;
+}
+
+uint32_t heap_node_size(const Heap *heap, const void *heap_base, const HeapNode *node)
+{
+	uint32_t node_real_next = node->next_node_offset == NULL_OFFSET ? heap_capacity(heap) : node->next_node_offset;
+	return node_real_next - pointer_to_offset(heap_base, node);
+}
+
+// Bin containing blocks of the given size.
+void heap_mapping_insert(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+	uint32_t msb = bit_scan_reverse(size);
+	*fl = msb - HEAP_FL_SHIFT;
+	*sl = (size >> (msb - HEAP_SL_BITS)) ^ HEAP_SL_COUNT;
+}
+
+// Lowest bin in which every block is at least the given size. Returns false
+// if no such bin exists.
+bool heap_mapping_search(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+	uint32_t round = (1U << (bit_scan_reverse(size) - HEAP_SL_BITS)) - 1;
+	if (size > UINT32_MAX - round)
+		return false;
+
+	heap_mapping_insert(size + round, fl, sl);
+	return *fl < HEAP_FL_COUNT;
+}
+
+// Find the first non-empty bin at or above the given bin.
+bool heap_find_bin(const Heap *heap, uint32_t *fl, uint32_t *sl)
+{
+	uint32_t sl_map = heap->sl_bitmap[*fl] & (~0U << *sl);
+
+	if (!sl_map) {
+		uint32_t fl_map = heap->fl_bitmap & (~0U << (*fl + 1));
+		if (!fl_map)
+			return false;
+
+		*fl = bit_scan_forward(fl_map);
+		sl_map = heap->sl_bitmap[*fl];
+	}
+
+	*sl = bit_scan_forward(sl_map);
+	return true;
+}
+
+uint32_t tree_height(const void *heap_base, uint32_t offset)
+{
+	return offset == NULL_OFFSET ? 0 : offset_to_pointer<const HeapNode>(heap_base, offset)->free_height;
+}
+
+void tree_update_height(void *heap_base, HeapNode *node)
+{
+	uint32_t left = tree_height(heap_base, node->prev_free_offset);
+	uint32_t right = tree_height(heap_base, node->next_free_offset);
+	node->free_height = (left > right ? left : right) + 1;
+}
+
+uint32_t tree_rotate_left(void *heap_base, uint32_t offset)
+{
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, offset);
+	uint32_t right_offset = node->next_free_offset;
+	HeapNode *right = offset_to_pointer<HeapNode>(heap_base, right_offset);
+
+	node->next_free_offset = right->prev_free_offset;
+	right->prev_free_offset = offset;
+
+	tree_update_height(heap_base, node);
+	tree_update_height(heap_base, right);
+	return right_offset;
+}
+
+uint32_t tree_rotate_right(void *heap_base, uint32_t offset)
+{
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, offset);
+	uint32_t left_offset = node->prev_free_offset;
+	HeapNode *left = offset_to_pointer<HeapNode>(heap_base, left_offset);
+
+	node->prev_free_offset = left->next_free_offset;
+	left->next_free_offset = offset;
+
+	tree_update_height(heap_base, node);
+	tree_update_height(heap_base, left);
+	return left_offset;
+}
+
+// Restore the AVL invariant at the given subtree and return its new root.
+uint32_t tree_balance(void *heap_base, uint32_t offset)
+{
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, offset);
+	uint32_t left = tree_height(heap_base, node->prev_free_offset);
+	uint32_t right = tree_height(heap_base, node->next_free_offset);
+
+	if (left > right + 1) {
+		HeapNode *child = offset_to_pointer<HeapNode>(heap_base, node->prev_free_offset);
+		if (tree_height(heap_base, child->prev_free_offset) < tree_height(heap_base, child->next_free_offset))
+			node->prev_free_offset = tree_rotate_left(heap_base, node->prev_free_offset);
+		return tree_rotate_right(heap_base, offset);
+	}
+	if (right > left + 1) {
+		HeapNode *child = offset_to_pointer<HeapNode>(heap_base, node->next_free_offset);
+		if (tree_height(heap_base, child->next_free_offset) < tree_height(heap_base, child->prev_free_offset))
+			node->next_free_offset = tree_rotate_right(heap_base, node->next_free_offset);
+		return tree_rotate_left(heap_base, offset);
+	}
+
+	tree_update_height(heap_base, node);
+	return offset;
+}
+
+// Free blocks are ordered by size, then by address.
+bool tree_less(uint32_t size, uint32_t offset, uint32_t other_size, uint32_t other_offset)
+{
+	return size < other_size || (size == other_size && offset < other_offset);
+}
+
+uint32_t tree_insert(const Heap *heap, void *heap_base, uint32_t root, uint32_t offset, uint32_t size)
+{
+	if (root == NULL_OFFSET)
+		return offset;
+
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, root);
+
+	if (tree_less(size, offset, heap_node_size(heap, heap_base, node), root))
+		node->prev_free_offset = tree_insert(heap, heap_base, node->prev_free_offset, offset, size);
+	else
+		node->next_free_offset = tree_insert(heap, heap_base, node->next_free_offset, offset, size);
+
+	return tree_balance(heap_base, root);
+}
+
+uint32_t tree_remove_min(void *heap_base, uint32_t root, uint32_t *min_offset)
+{
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, root);
+
+	if (node->prev_free_offset == NULL_OFFSET) {
+		*min_offset = root;
+		return node->next_free_offset;
+	}
+
+	node->prev_free_offset = tree_remove_min(heap_base, node->prev_free_offset, min_offset);
+	return tree_balance(heap_base, root);
+}
+
+uint32_t tree_remove(const Heap *heap, void *heap_base, uint32_t root, uint32_t offset, uint32_t size)
+{
+	assert(root != NULL_OFFSET);
+	HeapNode *node = offset_to_pointer<HeapNode>(heap_base, root);
+
+	if (root == offset) {
+		if (node->prev_free_offset == NULL_OFFSET)
+			return node->next_free_offset;
+		if (node->next_free_offset == NULL_OFFSET)
+			return node->prev_free_offset;
+
+		// Replace the block with its successor.
+		uint32_t successor_offset;
+		uint32_t right = tree_remove_min(heap_base, node->next_free_offset, &successor_offset);
+
+		HeapNode *successor = offset_to_pointer<HeapNode>(heap_base, successor_offset);
+		successor->prev_free_offset = node->prev_free_offset;
+		successor->next_free_offset = right;
+		return tree_balance(heap_base, successor_offset);
+	}
+
+	if (tree_less(size, offset, heap_node_size(heap, heap_base, node), root))
+		node->prev_free_offset = tree_remove(heap, heap_base, node->prev_free_offset, offset, size);
+	else
+		node->next_free_offset = tree_remove(heap, heap_base, node->next_free_offset, offset, size);
+
+	return tree_balance(heap_base, root);
+}
+
+
+// Index of the free blocks maintained by each allocation policy. Blocks must
+// be removed from the index before they are resized.
+template <class Policy>
+struct HeapIndex;
+
+template <>
+struct HeapIndex<FirstFitPolicy> {
+	// Smallest remainder split off an allocated block.
+	static constexpr uint32_t split_threshold = 4096;
+
+	static void init(Heap *heap)
+	{
+		heap->last_free_offset = NULL_OFFSET;
+		heap->largest_free_size = 0;
+		heap->largest_free_stale = 0;
+	}
+
+	static void insert(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		uint32_t size = heap_node_size(heap, heap_base, node);
+
+		heap->last_free_offset = pointer_to_offset(heap_base, node);
+
+		if (size >= heap->largest_free_size) {
+			heap->largest_free_size = size;
+			heap->largest_free_stale = 0;
+		}
+	}
+
+	static void remove(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		if (heap->last_free_offset == pointer_to_offset(heap_base, node))
+			heap->last_free_offset = NULL_OFFSET;
+		if (heap_node_size(heap, heap_base, node) == heap->largest_free_size)
+			heap->largest_free_stale = 1;
+	}
+
+	// Scan forward from the hint, then backward. A failed scan has seen every
+	// block, so it also finds the largest one.
+	static HeapNode *find(Heap *heap, void *heap_base, uint32_t size, uint32_t *scanned)
+	{
+		if (!heap->largest_free_stale && size > heap->largest_free_size)
+			return nullptr;
+
+		HeapNode *initial = heap->last_free_offset == NULL_OFFSET ? static_cast<HeapNode *>(heap_base) : offset_to_pointer<HeapNode>(heap_base, heap->last_free_offset);
+		uint32_t largest = 0;
+
+		for (HeapNode *node = initial; ; node = offset_to_pointer<HeapNode>(heap_base, node->next_node_offset)) {
+			assert(check_fourcc(node->magic, "memz"));
+			++*scanned;
+
+			if (!(node->flags & HEAP_FLAG_ALLOCATED)) {
+				uint32_t node_size = heap_node_size(heap, heap_base, node);
+				if (node_size >= size)
+					return node;
+				largest = node_size > largest ? node_size : largest;
+			}
+			if (node->next_node_offset == NULL_OFFSET)
+				break;
+		}
+
+		for (HeapNode *node = initial; node->prev_node_offset != NULL_OFFSET; ) {
+			node = offset_to_pointer<HeapNode>(heap_base, node->prev_node_offset);
+			assert(check_fourcc(node->magic, "memz"));
+			++*scanned;
+
+			if (!(node->flags & HEAP_FLAG_ALLOCATED)) {
+				uint32_t node_size = heap_node_size(heap, heap_base, node);
+				if (node_size >= size)
+					return node;
+				largest = node_size > largest ? node_size : largest;
+			}
+		}
+
+		heap->largest_free_size = largest;
+		heap->largest_free_stale = 0;
+		return nullptr;
+	}
+
+	// There is no index, so the entire heap is scanned if the largest block
+	// has been removed. Only called for statistics.
+	static uint32_t largest(Heap *heap, const void *heap_base)
+	{
+		if (!heap->largest_free_stale)
+			return heap->largest_free_size;
+
+		const HeapNode *node = static_cast<const HeapNode *>(heap_base);
+		uint32_t largest = 0;
+
+		while (true) {
+			uint32_t size = heap_node_size(heap, heap_base, node);
+
+			if (!(node->flags & HEAP_FLAG_ALLOCATED) && size > largest)
+				largest = size;
+			if (node->next_node_offset == NULL_OFFSET)
+				break;
+
+			node = offset_to_pointer<const HeapNode>(heap_base, node->next_node_offset);
+		}
+
+		heap->largest_free_size = largest;
+		heap->largest_free_stale = 0;
+		return largest;
+	}
+};
+
+template <>
+struct HeapIndex<SegregatedFitPolicy> {
+	static constexpr uint32_t split_threshold = sizeof(HeapNode);
+
+	static void init(Heap *heap)
+	{
+		heap->fl_bitmap = 0;
+
+		for (uint32_t &bitmap : heap->sl_bitmap) {
+			bitmap = 0;
+		}
+		for (uint32_t &offset : heap->free_bins) {
+			offset = NULL_OFFSET;
+		}
+		for (uint32_t &size : heap->bin_max_size) {
+			size = 0;
+		}
+	}
+
+	static void insert(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		uint32_t size = heap_node_size(heap, heap_base, node);
+		uint32_t fl, sl;
+		heap_mapping_insert(size, &fl, &sl);
+
+		uint32_t &head = heap->free_bins[fl * HEAP_SL_COUNT + sl];
+		uint32_t &max_size = heap->bin_max_size[fl * HEAP_SL_COUNT + sl];
+		uint32_t node_offset = pointer_to_offset(heap_base, node);
+
+		// An unknown maximum stays unknown, unless the bin was empty.
+		if (head == NULL_OFFSET || (max_size && size > max_size))
+			max_size = size;
+
+		node->prev_free_offset = NULL_OFFSET;
+		node->next_free_offset = head;
+
+		if (head != NULL_OFFSET)
+			offset_to_pointer<HeapNode>(heap_base, head)->prev_free_offset = node_offset;
+
+		head = node_offset;
+		heap->fl_bitmap |= 1U << fl;
+		heap->sl_bitmap[fl] |= 1U << sl;
+	}
+
+	static void remove(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		uint32_t size = heap_node_size(heap, heap_base, node);
+		uint32_t fl, sl;
+		heap_mapping_insert(size, &fl, &sl);
+
+		uint32_t &head = heap->free_bins[fl * HEAP_SL_COUNT + sl];
+		uint32_t &max_size = heap->bin_max_size[fl * HEAP_SL_COUNT + sl];
+
+		if (size == max_size)
+			max_size = 0;
+
+		if (node->prev_free_offset != NULL_OFFSET)
+			offset_to_pointer<HeapNode>(heap_base, node->prev_free_offset)->next_free_offset = node->next_free_offset;
+		else
+			head = node->next_free_offset;
+
+		if (node->next_free_offset != NULL_OFFSET)
+			offset_to_pointer<HeapNode>(heap_base, node->next_free_offset)->prev_free_offset = node->prev_free_offset;
+
+		if (head == NULL_OFFSET) {
+			heap->sl_bitmap[fl] &= ~(1U << sl);
+			if (!heap->sl_bitmap[fl])
+				heap->fl_bitmap &= ~(1U << fl);
+		}
+
+		node->prev_free_offset = NULL_OFFSET;
+		node->next_free_offset = NULL_OFFSET;
+	}
+
+	static HeapNode *find(Heap *heap, void *heap_base, uint32_t size, uint32_t *scanned)
+	{
+		// Try the head of the exact bin first. Blocks of recurring sizes, such
+		// as frame buffers, are likely to be found there.
+		uint32_t fl, sl;
+		heap_mapping_insert(size, &fl, &sl);
+
+		uint32_t head = heap->free_bins[fl * HEAP_SL_COUNT + sl];
+
+		if (head != NULL_OFFSET) {
+			HeapNode *node = offset_to_pointer<HeapNode>(heap_base, head);
+			++*scanned;
+
+			if (heap_node_size(heap, heap_base, node) >= size)
+				return node;
+		}
+
+		if (!heap_mapping_search(size, &fl, &sl) || !heap_find_bin(heap, &fl, &sl))
+			return nullptr;
+
+		++*scanned;
+		return offset_to_pointer<HeapNode>(heap_base, heap->free_bins[fl * HEAP_SL_COUNT + sl]);
+	}
+
+	// The largest free block is in the highest non-empty bin. Its maximum is
+	// only searched for again after the largest block was removed.
+	static uint32_t largest(Heap *heap, const void *heap_base)
+	{
+		if (!heap->fl_bitmap)
+			return 0;
+
+		uint32_t fl = bit_scan_reverse(heap->fl_bitmap);
+		uint32_t sl = bit_scan_reverse(heap->sl_bitmap[fl]);
+		uint32_t &max_size = heap->bin_max_size[fl * HEAP_SL_COUNT + sl];
+		if (max_size)
+			return max_size;
+
+		uint32_t offset = heap->free_bins[fl * HEAP_SL_COUNT + sl];
+		uint32_t largest = 0;
+
+		while (offset != NULL_OFFSET) {
+			const HeapNode *node = offset_to_pointer<const HeapNode>(heap_base, offset);
+			uint32_t size = heap_node_size(heap, heap_base, node);
+
+			largest = size > largest ? size : largest;
+			offset = node->next_free_offset;
+		}
+
+		max_size = largest;
+		return largest;
+	}
+};
+
+template <>
+struct HeapIndex<BestFitPolicy> {
+	static constexpr uint32_t split_threshold = sizeof(HeapNode);
+
+	static void init(Heap *heap)
+	{
+		heap->free_root_offset = NULL_OFFSET;
+	}
 
-	if (alloc_size % alignof(HeapNode))
-		alloc_size += alignof(HeapNode) - alloc_size % alignof(HeapNode);
+	static void insert(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		uint32_t node_offset = pointer_to_offset(heap_base, node);
+
+		node->prev_free_offset = NULL_OFFSET;
+		node->next_free_offset = NULL_OFFSET;
+		node->free_height = 1;
+
+		heap->free_root_offset = tree_insert(heap, heap_base, heap->free_root_offset, node_offset, heap_node_size(heap, heap_base, node));
+	}
+
+	static void remove(Heap *heap, void *heap_base, HeapNode *node)
+	{
+		uint32_t node_offset = pointer_to_offset(heap_base, node);
+
+		heap->free_root_offset = tree_remove(heap, heap_base, heap->free_root_offset, node_offset, heap_node_size(heap, heap_base, node));
+
+		node->prev_free_offset = NULL_OFFSET;
+		node->next_free_offset = NULL_OFFSET;
+		node->free_height = 0;
+	}
+
+	// Smallest block of at least the given size, preferring lower addresses.
+	static HeapNode *find(Heap *heap, void *heap_base, uint32_t size, uint32_t *scanned)
+	{
+		HeapNode *best = nullptr;
+		uint32_t offset = heap->free_root_offset;
+
+		while (offset != NULL_OFFSET) {
+			HeapNode *node = offset_to_pointer<HeapNode>(heap_base, offset);
+			++*scanned;
+
+			if (heap_node_size(heap, heap_base, node) >= size) {
+				best = node;
+				offset = node->prev_free_offset;
+			} else {
+				offset = node->next_free_offset;
+			}
+		}
+
+		return best;
+	}
+
+	static uint32_t largest(const Heap *heap, const void *heap_base)
+	{
+		uint32_t offset = heap->free_root_offset;
+		if (offset == NULL_OFFSET)
+			return 0;
+
+		const HeapNode *node = offset_to_pointer<const HeapNode>(heap_base, offset);
+		while (node->next_free_offset != NULL_OFFSET) {
+			node = offset_to_pointer<const HeapNode>(heap_base, node->next_free_offset);
+		}
+
+		return heap_node_size(heap, heap_base, node);
+	}
+};
+
+// Counters are only written by the owner, so read-modify-write cycles do not
+// need to be atomic.
+template <class T, class U>
+void counter_add(std::atomic<T> &counter, U value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+template <class T, class U>
+void counter_max(std::atomic<T> &counter, U value)
+{
+	if (value > counter.load(std::memory_order_relaxed))
+		counter.store(value, std::memory_order_relaxed);
+}
+
+// Split the block after (size) bytes and return the remainder.
+HeapNode *split_heap_node(void *heap_base, HeapNode *node, uint32_t size)
+{
+	uint32_t node_offset = pointer_to_offset(heap_base, node);
 
-	HeapNode *next = new (offset_to_pointer<void>(heap_base, node_offset + alloc_size)) HeapNode{};
+	HeapNode *next = new (offset_to_pointer<void>(heap_base, node_offset + size)) HeapNode{};
 	next->prev_node_offset = node_offset;
 	next->next_node_offset = node->next_node_offset;
 
-	node->next_node_offset = node_offset + alloc_size;
+	if (next->next_node_offset != NULL_OFFSET)
+		offset_to_pointer<HeapNode>(heap_base, next->next_node_offset)->prev_node_offset = node_offset + size;
+
+	node->next_node_offset = node_offset + size;
+	return next;
+}
+
+// Absorb the following block into the given block.
+void merge_heap_node(void *heap_base, HeapNode *node, HeapNode *next)
+{
+	node->next_node_offset = next->next_node_offset;
+
+	if (node->next_node_offset != NULL_OFFSET)
+		offset_to_pointer<HeapNode>(heap_base, node->next_node_offset)->prev_node_offset = pointer_to_offset(heap_base, node);
+
+	std::memset(next->magic, 0, sizeof(next->magic));
 }
 
 } // namespace
 
 
-void queue_read(Queue *queue, void *buf)
+uint32_t queue_readable(const Queue *queue)
 {
-	unsigned char *queue_base = offset_to_pointer<unsigned char>(queue, queue->buffer_offset);
 	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t read_pos = queue->read_pos.load(std::memory_order_relaxed);
+	uint32_t write_pos = queue->write_pos.load(std::memory_order_acquire);
 
-	if (queue->buffer_usage <= capacity - queue->read_pos) {
-		std::memcpy(buf, queue_base + queue->read_pos, queue->buffer_usage);
-		queue->read_pos += queue->buffer_usage;
+	return write_pos >= read_pos ? write_pos - read_pos : capacity - read_pos + write_pos;
+}
+
+uint32_t queue_writable(const Queue *queue)
+{
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t read_pos = queue->read_pos.load(std::memory_order_acquire);
+	uint32_t write_pos = queue->write_pos.load(std::memory_order_relaxed);
+
+	return (write_pos >= read_pos ? capacity - write_pos + read_pos : read_pos - write_pos) - 1;
+}
+
+void queue_read(Queue *queue, void *buf, uint32_t size)
+{
+	const unsigned char *queue_base = offset_to_pointer<const unsigned char>(queue, queue->buffer_offset);
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t read_pos = queue->read_pos.load(std::memory_order_relaxed);
+
+	assert(size <= queue_readable(queue));
+
+	if (size <= capacity - read_pos) {
+		std::memcpy(buf, queue_base + read_pos, size);
+		read_pos += size;
 	} else {
-		uint32_t read_first = capacity - queue->read_pos;
-		std::memcpy(buf, queue_base + queue->read_pos, read_first);
+		uint32_t read_first = capacity - read_pos;
+		std::memcpy(buf, queue_base + read_pos, read_first);
 
 		buf = offset_to_pointer<void>(buf, read_first);
-		std::memcpy(buf, queue_base, queue->buffer_usage - read_first);
+		std::memcpy(buf, queue_base, size - read_first);
 
-		queue->read_pos = queue->buffer_usage - read_first;
+		read_pos = size - read_first;
 	}
 
-	queue->buffer_usage = 0;
+	// Release the space only after the commands have been copied out.
+	queue->read_pos.store(read_pos == capacity ? 0 : read_pos, std::memory_order_release);
+}
+
+const void *queue_peek(const Queue *queue, uint32_t offset, uint32_t size, void *scratch)
+{
+	const unsigned char *queue_base = offset_to_pointer<const unsigned char>(queue, queue->buffer_offset);
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t pos = queue->read_pos.load(std::memory_order_relaxed);
+
+	assert(offset <= queue_readable(queue) && size <= queue_readable(queue) - offset);
+
+	pos = offset < capacity - pos ? pos + offset : offset - (capacity - pos);
+	if (size <= capacity - pos)
+		return queue_base + pos;
+
+	uint32_t read_first = capacity - pos;
+	std::memcpy(scratch, queue_base + pos, read_first);
+	std::memcpy(offset_to_pointer<void>(scratch, read_first), queue_base, size - read_first);
+	return scratch;
+}
+
+void queue_consume(Queue *queue, uint32_t size)
+{
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t read_pos = queue->read_pos.load(std::memory_order_relaxed);
+
+	assert(size <= queue_readable(queue));
+
+	read_pos = size < capacity - read_pos ? read_pos + size : size - (capacity - read_pos);
+	queue->read_pos.store(read_pos, std::memory_order_release);
 }
 
 void queue_write(Queue *queue, const void *buf, uint32_t size)
 {
 	unsigned char *queue_base = offset_to_pointer<unsigned char>(queue, queue->buffer_offset);
 	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t write_pos = queue->write_pos.load(std::memory_order_relaxed);
 
-	assert(size <= capacity - queue->buffer_usage);
+	assert(size <= queue_writable(queue));
 
-	if (size <= capacity - queue->write_pos) {
-		std::memcpy(queue_base + queue->write_pos, buf, size);
-		queue->write_pos += size;
+	if (size <= capacity - write_pos) {
+		std::memcpy(queue_base + write_pos, buf, size);
+		write_pos += size;
 	} else {
-		uint32_t write_first = capacity - queue->write_pos;
-		std::memcpy(queue_base + queue->write_pos, buf, write_first);
+		uint32_t write_first = capacity - write_pos;
+		std::memcpy(queue_base + write_pos, buf, write_first);
 
-		buf = offset_to_pointer<void>(buf, write_first);
+		buf = offset_to_pointer<const void>(buf, write_first);
 		std::memcpy(queue_base, buf, size - write_first);
 
-		queue->write_pos = size - write_first;
+		write_pos = size - write_first;
 	}
 
-	queue->buffer_usage += size;
+	// Publish the commands only after they have been copied in.
+	queue->write_pos.store(write_pos == capacity ? 0 : write_pos, std::memory_order_release);
 }
 
-HeapNode *heap_alloc(Heap *heap, uint32_t size)
+void *queue_reserve(Queue *queue, uint32_t size)
 {
-	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
-	uint32_t capacity = heap->size - heap->buffer_offset;
+	unsigned char *queue_base = offset_to_pointer<unsigned char>(queue, queue->buffer_offset);
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t write_pos = queue->write_pos.load(std::memory_order_relaxed);
 
-	if (size > capacity - sizeof(HeapNode))
-		return nullptr;
+	assert(size <= queue_writable(queue));
+	return size <= capacity - write_pos ? queue_base + write_pos : nullptr;
+}
 
-	size += sizeof(HeapNode);
-	if (size > capacity - heap->buffer_usage)
-		return nullptr;
+void queue_commit(Queue *queue, uint32_t size)
+{
+	uint32_t capacity = queue->size - queue->buffer_offset;
+	uint32_t write_pos = queue->write_pos.load(std::memory_order_relaxed);
+
+	assert(size <= queue_writable(queue) && size <= capacity - write_pos);
+	write_pos += size;
+
+	// Publish the commands only after they have been serialized.
+	queue->write_pos.store(write_pos == capacity ? 0 : write_pos, std::memory_order_release);
+}
 
-	// Try the hint first.
-	HeapNode *node = static_cast<HeapNode *>(heap_base);
-	if (heap->last_free_offset != NULL_OFFSET)
-		node = offset_to_pointer<HeapNode>(heap_base, heap->last_free_offset);
+template <class Policy>
+void heap_init(Heap *heap)
+{
+	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
 
-	// Forward scan.
-	HeapNode *initial = node;
+	assert(heap_capacity(heap) >= sizeof(HeapNode));
+	assert(heap_capacity(heap) % alignof(HeapNode) == 0);
+
+	heap->buffer_usage = 0;
+	heap->remote_free_offset = NULL_OFFSET;
+	heap->counters.bytes_in_use = 0;
+	heap->counters.peak_bytes_in_use = 0;
+	heap->counters.live_blocks = 0;
+	heap->counters.max_nodes_scanned = 0;
+	heap->counters.alloc_failures = 0;
+	heap->counters.alloc_count = 0;
+	heap->counters.nodes_scanned = 0;
+	heap->policy = Policy::id;
+
+	HeapIndex<Policy>::init(heap);
+	HeapIndex<Policy>::insert(heap, heap_base, new (heap_base) HeapNode{});
+	heap_update_stats<Policy>(heap);
+}
 
-	while (true) {
-		assert(check_fourcc(node->magic, "memz"));
+template <class Policy>
+HeapNode *heap_alloc(Heap *heap, uint32_t size, HeapCommitCallback commit)
+{
+	return heap_alloc_aligned<Policy>(heap, size, alignof(HeapNode), commit);
+}
 
-		uint32_t node_offset = pointer_to_offset(heap_base, node);
-		uint32_t node_real_next = node->next_node_offset == NULL_OFFSET ? capacity : node->next_node_offset;
-		uint32_t node_size = node_real_next - node_offset;
+template <class Policy>
+HeapNode *heap_alloc_aligned(Heap *heap, uint32_t size, uint32_t alignment, HeapCommitCallback commit)
+{
+	typedef HeapIndex<Policy> Index;
 
-		if (!(node->flags & HEAP_FLAG_ALLOCATED) && size < node_size) {
-			if (node_size - size >= 4096U) {
-				split_heap_node(heap_base, node, size);
-				node_real_next = node->next_node_offset;
-			}
+	assert(heap->policy == Policy::id);
+	assert(alignment >= alignof(HeapNode) && !(alignment & (alignment - 1)));
 
-			node->flags |= HEAP_FLAG_ALLOCATED;
-			heap->buffer_usage += node_real_next - node_offset;
-			return node;
-		}
+	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
+	uint32_t capacity = heap_capacity(heap);
 
-		if (node->next_node_offset == NULL_OFFSET)
-			break;
+	if (size > capacity - sizeof(HeapNode)) {
+		counter_add(heap->counters.alloc_failures, 1);
+		return nullptr;
+	}
 
-		node = offset_to_pointer<HeapNode>(heap_base, node->next_node_offset);
+	// The capacity is a multiple of the alignment, so this can not overflow.
+	size += sizeof(HeapNode);
+	if (size % alignof(HeapNode))
+		size += alignof(HeapNode) - size % alignof(HeapNode);
+	if (size > capacity - heap->buffer_usage) {
+		counter_add(heap->counters.alloc_failures, 1);
+		return nullptr;
 	}
 
-	// Reverse scan.
-	if (initial->prev_node_offset == NULL_OFFSET)
+	// Blocks are aligned to alignof(HeapNode), so aligning the payload needs
+	// at most this much padding in front of the block.
+	uint32_t max_padding = alignment - alignof(HeapNode);
+	if (max_padding > capacity - size) {
+		counter_add(heap->counters.alloc_failures, 1);
 		return nullptr;
+	}
 
-	node = offset_to_pointer<HeapNode>(heap_base, initial->prev_node_offset);
+	uint32_t scanned = 0;
+	HeapNode *node = Index::find(heap, heap_base, size + max_padding, &scanned);
 
-	while (true) {
-		assert(check_fourcc(node->magic, "memz"));
+	if (!node) {
+		counter_add(heap->counters.alloc_failures, 1);
+		return nullptr;
+	}
 
-		uint32_t node_offset = pointer_to_offset(heap_base, node);
-		uint32_t node_real_next = node->next_node_offset == NULL_OFFSET ? capacity : node->next_node_offset;
-		uint32_t node_size = node_real_next - node_offset;
+	assert(check_fourcc(node->magic, "memz"));
+	assert(!(node->flags & HEAP_FLAG_ALLOCATED));
+
+	uintptr_t payload = reinterpret_cast<uintptr_t>(node + 1);
+	uint32_t padding = static_cast<uint32_t>((alignment - payload % alignment) % alignment);
+	assert(padding % alignof(HeapNode) == 0);
+
+	uint32_t node_size = heap_node_size(heap, heap_base, node);
+	assert(node_size >= padding + size);
 
-		if (!(node->flags & HEAP_FLAG_ALLOCATED) && size < node_size) {
-			if (node_size - size >= 4096U)
-				split_heap_node(heap_base, node, size);
+	bool split = node_size - padding - size >= Index::split_threshold;
 
-			node->flags |= HEAP_FLAG_ALLOCATED;
-			return node;
+	// Commit the block and the header of the remainder before touching them.
+	uint32_t touched_end = pointer_to_offset(heap, node) + (split ? padding + size + sizeof(HeapNode) : node_size);
+	if (commit && touched_end > heap->committed_size.load(std::memory_order_relaxed)) {
+		uint32_t committed = commit(heap, touched_end);
+		if (committed < touched_end) {
+			counter_add(heap->counters.alloc_failures, 1);
+			return nullptr;
 		}
+		heap->committed_size.store(committed, std::memory_order_relaxed);
+	}
 
-		if (node->prev_node_offset == NULL_OFFSET)
-			break;
+	Index::remove(heap, heap_base, node);
 
-		node = offset_to_pointer<HeapNode>(heap_base, node->prev_node_offset);
+	// The padding remains free in front of the allocated block.
+	if (padding) {
+		HeapNode *aligned = split_heap_node(heap_base, node, padding);
+		Index::insert(heap, heap_base, node);
+		node = aligned;
+		node_size -= padding;
 	}
 
-	return nullptr;
+	if (split) {
+		Index::insert(heap, heap_base, split_heap_node(heap_base, node, size));
+		node_size = size;
+	}
+
+	node->flags |= HEAP_FLAG_ALLOCATED;
+	node->ref_count.store(1, std::memory_order_relaxed);
+	heap->buffer_usage += node_size;
+
+	HeapCounters &counters = heap->counters;
+	counters.bytes_in_use.store(heap->buffer_usage, std::memory_order_relaxed);
+	counter_max(counters.peak_bytes_in_use, heap->buffer_usage);
+	counter_add(counters.live_blocks, 1);
+	counter_max(counters.max_nodes_scanned, scanned);
+	counter_add(counters.alloc_count, 1);
+	counter_add(counters.nodes_scanned, scanned);
+
+	return node;
 }
 
+template <class Policy>
 void heap_free(Heap *heap, HeapNode *node)
 {
+	typedef HeapIndex<Policy> Index;
+
+	assert(heap->policy == Policy::id);
 	assert(check_fourcc(node->magic, "memz"));
 	assert(node->flags & HEAP_FLAG_ALLOCATED);
 
 	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
-	uint32_t capacity = heap->size - heap->buffer_offset;
 
-	uint32_t node_real_next = node->next_node_offset == NULL_OFFSET ? capacity : node->next_node_offset;
-	uint32_t node_real_size = node_real_next - pointer_to_offset(heap_base, node);
+	uint32_t node_real_size = heap_node_size(heap, heap_base, node);
 	assert(node_real_size <= heap->buffer_usage);
 
-	node->flags &= ~HEAP_FLAG_ALLOCATED;
+	node->flags &= ~(HEAP_FLAG_ALLOCATED | HEAP_FLAG_FRAME);
 	heap->buffer_usage -= node_real_size;
 
-	// Forward scan.
-	while (node->next_node_offset != NULL_OFFSET) {
+	// Free blocks are always coalesced, so at most one neighbour on each side
+	// needs to be merged.
+	if (node->next_node_offset != NULL_OFFSET) {
 		HeapNode *next = offset_to_pointer<HeapNode>(heap_base, node->next_node_offset);
 		assert(check_fourcc(next->magic, "memz"));
 
-		if (next->flags & HEAP_FLAG_ALLOCATED)
-			break;
-
-		node->next_node_offset = next->next_node_offset;
-		std::memset(next->magic, 0, sizeof(next->magic));
+		if (!(next->flags & HEAP_FLAG_ALLOCATED)) {
+			Index::remove(heap, heap_base, next);
+			merge_heap_node(heap_base, node, next);
+		}
 	}
 
-	// Reverse scan.
-	while (node->prev_node_offset != NULL_OFFSET) {
+	if (node->prev_node_offset != NULL_OFFSET) {
 		HeapNode *prev = offset_to_pointer<HeapNode>(heap_base, node->prev_node_offset);
 		assert(check_fourcc(prev->magic, "memz"));
 
-		if (prev->flags & HEAP_FLAG_ALLOCATED)
-			break;
+		if (!(prev->flags & HEAP_FLAG_ALLOCATED)) {
+			Index::remove(heap, heap_base, prev);
+			merge_heap_node(heap_base, prev, node);
+			node = prev;
+		}
+	}
+
+	Index::insert(heap, heap_base, node);
 
-		prev->next_node_offset = node->next_node_offset;
-		std::memset(node->magic, 0, sizeof(node->magic));
-		node = prev;
+	heap->counters.bytes_in_use.store(heap->buffer_usage, std::memory_order_relaxed);
+	heap->counters.live_blocks.store(heap->counters.live_blocks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+void heap_free_remote(Heap *heap, HeapNode *node)
+{
+	assert(check_fourcc(node->magic, "memz"));
+	assert(node->flags & HEAP_FLAG_ALLOCATED);
+
+	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
+	uint32_t node_offset = pointer_to_offset(heap_base, node);
+	uint32_t head = heap->remote_free_offset.load(std::memory_order_relaxed);
+
+	// The owner only ever detaches the entire list, so there is no ABA hazard.
+	do {
+		node->next_free_offset = head;
+	} while (!heap->remote_free_offset.compare_exchange_weak(head, node_offset, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template <class Policy>
+uint32_t heap_drain_remote(Heap *heap, HeapRecycleCallback recycle, void *opaque)
+{
+	if (heap->remote_free_offset.load(std::memory_order_relaxed) == NULL_OFFSET)
+		return 0;
+
+	void *heap_base = offset_to_pointer<void>(heap, heap->buffer_offset);
+	uint32_t offset = heap->remote_free_offset.exchange(NULL_OFFSET, std::memory_order_acquire);
+	uint32_t count = 0;
+
+	while (offset != NULL_OFFSET) {
+		HeapNode *node = offset_to_pointer<HeapNode>(heap_base, offset);
+		offset = node->next_free_offset;
+
+		node->next_free_offset = NULL_OFFSET;
+		if (!recycle || !recycle(opaque, heap, node))
+			heap_free<Policy>(heap, node);
+		++count;
 	}
 
-	heap->last_free_offset = pointer_to_offset(heap_base, node);
+	return count;
+}
+
+template <class Policy>
+void heap_update_stats(Heap *heap)
+{
+	const void *heap_base = offset_to_pointer<const void>(heap, heap->buffer_offset);
+	uint32_t largest = HeapIndex<Policy>::largest(heap, heap_base);
+	heap->counters.largest_free_block.store(largest ? largest - sizeof(HeapNode) : 0, std::memory_order_relaxed);
+}
+
+HeapStats heap_stats(const Heap *heap)
+{
+	const HeapCounters &counters = heap->counters;
+	HeapStats stats{};
+
+	stats.capacity = heap->size - heap->buffer_offset;
+	stats.committed = heap->committed_size.load(std::memory_order_relaxed);
+	stats.bytes_in_use = counters.bytes_in_use.load(std::memory_order_relaxed);
+	stats.peak_bytes_in_use = counters.peak_bytes_in_use.load(std::memory_order_relaxed);
+	stats.live_blocks = counters.live_blocks.load(std::memory_order_relaxed);
+	stats.largest_free_block = counters.largest_free_block.load(std::memory_order_relaxed);
+	stats.max_nodes_scanned = counters.max_nodes_scanned.load(std::memory_order_relaxed);
+	stats.alloc_failures = counters.alloc_failures.load(std::memory_order_relaxed);
+	stats.alloc_count = counters.alloc_count.load(std::memory_order_relaxed);
+
+	uint64_t nodes_scanned = counters.nodes_scanned.load(std::memory_order_relaxed);
+	stats.avg_nodes_scanned = stats.alloc_count ? static_cast<double>(nodes_scanned) / stats.alloc_count : 0.0;
+
+	uint32_t free_bytes = stats.bytes_in_use <= stats.capacity ? stats.capacity - stats.bytes_in_use : 0;
+	stats.fragmentation = free_bytes ? 1.0 - static_cast<double>(stats.largest_free_block) / free_bytes : 0.0;
+	if (stats.fragmentation < 0.0)
+		stats.fragmentation = 0.0;
+
+	return stats;
 }
 
+void heap_retain(HeapNode *node)
+{
+	assert(check_fourcc(node->magic, "memz"));
+	assert(node->flags & HEAP_FLAG_ALLOCATED);
+
+	assert(node->ref_count.load(std::memory_order_relaxed) > 0);
+	node->ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool heap_release(HeapNode *node)
+{
+	assert(check_fourcc(node->magic, "memz"));
+	assert(node->flags & HEAP_FLAG_ALLOCATED);
+
+	// Writes made through other references must be visible before the block
+	// is freed or reused.
+	uint32_t prev = node->ref_count.fetch_sub(1, std::memory_order_acq_rel);
+	assert(prev > 0);
+	return prev == 1;
+}
+
+uint32_t heap_usable_size(const Heap *heap, const HeapNode *node)
+{
+	const void *heap_base = offset_to_pointer<const void>(heap, heap->buffer_offset);
+	return heap_node_size(heap, heap_base, node) - sizeof(HeapNode);
+}
+
+
+template void heap_init<FirstFitPolicy>(Heap *heap);
+template HeapNode *heap_alloc<FirstFitPolicy>(Heap *heap, uint32_t size, HeapCommitCallback commit);
+template HeapNode *heap_alloc_aligned<FirstFitPolicy>(Heap *heap, uint32_t size, uint32_t alignment, HeapCommitCallback commit);
+template void heap_free<FirstFitPolicy>(Heap *heap, HeapNode *node);
+template uint32_t heap_drain_remote<FirstFitPolicy>(Heap *heap, HeapRecycleCallback recycle, void *opaque);
+template void heap_update_stats<FirstFitPolicy>(Heap *heap);
+
+template void heap_init<SegregatedFitPolicy>(Heap *heap);
+template HeapNode *heap_alloc<SegregatedFitPolicy>(Heap *heap, uint32_t size, HeapCommitCallback commit);
+template HeapNode *heap_alloc_aligned<SegregatedFitPolicy>(Heap *heap, uint32_t size, uint32_t alignment, HeapCommitCallback commit);
+template void heap_free<SegregatedFitPolicy>(Heap *heap, HeapNode *node);
+template uint32_t heap_drain_remote<SegregatedFitPolicy>(Heap *heap, HeapRecycleCallback recycle, void *opaque);
+template void heap_update_stats<SegregatedFitPolicy>(Heap *heap);
+
+template void heap_init<BestFitPolicy>(Heap *heap);
+template HeapNode *heap_alloc<BestFitPolicy>(Heap *heap, uint32_t size, HeapCommitCallback commit);
+template HeapNode *heap_alloc_aligned<BestFitPolicy>(Heap *heap, uint32_t size, uint32_t alignment, HeapCommitCallback commit);
+template void heap_free<BestFitPolicy>(Heap *heap, HeapNode *node);
+template uint32_t heap_drain_remote<BestFitPolicy>(Heap *heap, HeapRecycleCallback recycle, void *opaque);
+template void heap_update_stats<BestFitPolicy>(Heap *heap);
+
 } // namespace ipc
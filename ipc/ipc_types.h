@@ -3,17 +3,29 @@
 #ifndef IPC_IPC_TYPES_H_
 #define IPC_IPC_TYPES_H_
 
+#include <atomic>
 #include <cstdint>
 
 namespace ipc {
 
-// IPC protocol version.
-constexpr int32_t VERSION = 0;
+// IPC protocol version. Bumped for every change to the commands or to the
+// layout of the structures in shared memory.
+constexpr int32_t VERSION = 17;
 
 // Offset representing a null pointer in the IPC heap.
 constexpr uint32_t NULL_OFFSET = ~static_cast<uint32_t>(0);
 
 
+// Lock the warmed up range of the heaps into the working set.
+constexpr uint32_t WARM_UP_LOCK = 1;
+
+// Auto-reset event shared between the processes. On Windows, the value of an
+// inheritable event handle. On POSIX, a futex word.
+struct SharedEvent {
+	uint32_t handle = 0;
+	std::atomic_uint32_t signaled{ 0 };
+};
+
 // Header of the IPC shared memory. It must be present at offset 0.
 struct alignas(64) SharedMemoryHeader {
 	int8_t magic[4] = { 'a', 'v', 's', 'w' };
@@ -25,30 +37,51 @@ struct alignas(64) SharedMemoryHeader {
 	uint32_t master_queue_offset = NULL_OFFSET;
 	// Offset from SharedMemoryHeader to the slave->master queue.
 	uint32_t slave_queue_offset = NULL_OFFSET;
-	// Offset from SharedMemoryHeader to the IPC heap.
-	uint32_t heap_offset = NULL_OFFSET;
+	// Offset from SharedMemoryHeader to the master->slave urgent queue. The
+	// reader drains it before the regular queue.
+	uint32_t master_urgent_queue_offset = NULL_OFFSET;
+	// Offset from SharedMemoryHeader to the slave->master urgent queue.
+	uint32_t slave_urgent_queue_offset = NULL_OFFSET;
+	// Offset from SharedMemoryHeader to the heap owned by the master.
+	uint32_t master_heap_offset = NULL_OFFSET;
+	// Offset from SharedMemoryHeader to the heap owned by the slave.
+	uint32_t slave_heap_offset = NULL_OFFSET;
+	// Number of bytes at the start of each heap to fault in when a process
+	// attaches. The range is committed by the master.
+	uint32_t warm_up_size = 0;
+	// WARM_UP flags.
+	uint32_t warm_up_flags = 0;
+	// Used by the slave to wait for commands in either master queue.
+	SharedEvent master_event;
+	// Used by the master to wait for commands in either slave queue.
+	SharedEvent slave_event;
 };
 
-// Unidirectional command queue. The queue buffer immediately follows.
+// Unidirectional single-producer, single-consumer command queue. The queue
+// buffer immediately follows. The buffer is empty when the positions are
+// equal, so one byte is always left unused.
 struct alignas(64) Queue {
 	int8_t magic[4] = { 'c', 'm', 'd', 'q' };
 	// Size of the queue and subsequent command buffer.
 	uint32_t size = 0;
-	// Win32 event used by the reader to wait for commands.
-	uint32_t event_handle = 0;
-	// Win32 mutex protecting the queue.
-	uint32_t mutex_handle = 0;
+	// Used by the writer to wait for space in a full queue.
+	SharedEvent space_event;
 	// Offset from Queue to the command buffer.
 	uint32_t buffer_offset = sizeof(Queue);
-	// Number of bytes in use in the buffer, up to (size - sizeof(Queue)).
-	uint32_t buffer_usage = 0;
-	// Offset from command buffer to reader position.
-	uint32_t read_pos = 0;
-	// Offset from command buffer to writer position.
-	uint32_t write_pos = 0;
+	// Offset from command buffer to writer position. Only stored by the writer.
+	alignas(64) std::atomic_uint32_t write_pos{ 0 };
+	// Offset from command buffer to reader position. Only stored by the reader.
+	alignas(64) std::atomic_uint32_t read_pos{ 0 };
+	// Set by the writer while it waits for space. The reader clears it and sets
+	// the space event after reading.
+	std::atomic_uint32_t writer_waiting{ 0 };
+	// Set by the reader while it is blocked on the event. The writer only sets
+	// the event if the reader is waiting.
+	std::atomic_uint32_t reader_waiting{ 0 };
 };
 
-// Command object in queue. The command payload immediately follows.
+// Command object in queue. The command payload immediately follows, padded to
+// the alignment of Command.
 struct alignas(8) Command {
 	int8_t magic[4] = { 'c', 'm', 'd', 'x' };
 	// Size of the command and subsequent payload.
@@ -61,46 +94,246 @@ struct alignas(8) Command {
 	int32_t type;
 };
 
-// Heap for memory allocation. The heap buffer immediately follows.
+// Payload of a command with magic 'cmdh', sent through the queue in place of a
+// command too large to be inlined. The rest of the header is copied from the
+// spilled command, which is freed by the recipient.
+struct SpilledCommand {
+	// Offset from SharedMemoryHeader to the command in the sender's heap.
+	uint32_t command_offset;
+	// Size of the command and subsequent payload.
+	uint32_t size;
+};
+
+// Allocation policies of the heap. The policy is selected at build time by
+// defining IPC_HEAP_POLICY, and both processes must be built with the same one.
+// The heap functions are instantiated for each policy in ipc_types.cpp.
+
+// Address-ordered first fit, starting from the most recently freed block.
+struct FirstFitPolicy { static constexpr uint32_t id = 1; };
+// Two-level segregated fit with constant time allocation.
+struct SegregatedFitPolicy { static constexpr uint32_t id = 2; };
+// Best fit over a balanced tree of free blocks ordered by size.
+struct BestFitPolicy { static constexpr uint32_t id = 3; };
+
+#ifndef IPC_HEAP_POLICY
+  #define IPC_HEAP_POLICY SegregatedFitPolicy
+#endif
+
+typedef IPC_HEAP_POLICY HeapPolicy;
+
+// Free blocks are binned by size in a two-level segregated fit scheme. The
+// first level is the power-of-two size class and the second level divides
+// each class into HEAP_SL_COUNT linear ranges.
+constexpr uint32_t HEAP_FL_SHIFT = 6;
+constexpr uint32_t HEAP_FL_COUNT = 32 - HEAP_FL_SHIFT;
+constexpr uint32_t HEAP_SL_BITS = 2;
+constexpr uint32_t HEAP_SL_COUNT = 1U << HEAP_SL_BITS;
+constexpr uint32_t HEAP_BIN_COUNT = HEAP_FL_COUNT * HEAP_SL_COUNT;
+
+// Allocation counters of a heap. Updated by the owner of the heap and readable
+// by either process without locking.
+struct alignas(8) HeapCounters {
+	// Number of bytes allocated, including block headers.
+	std::atomic_uint32_t bytes_in_use{};
+	// Highest value of bytes_in_use.
+	std::atomic_uint32_t peak_bytes_in_use{};
+	// Number of allocated blocks.
+	std::atomic_uint32_t live_blocks{};
+	// Usable size of the largest free block, as of the last heap_update_stats.
+	std::atomic_uint32_t largest_free_block{};
+	// Highest number of blocks examined by a single allocation.
+	std::atomic_uint32_t max_nodes_scanned{};
+	// Number of allocations that could not be satisfied.
+	std::atomic_uint32_t alloc_failures{};
+	// Number of successful allocations.
+	std::atomic<uint64_t> alloc_count{};
+	// Number of blocks examined by all allocations.
+	std::atomic<uint64_t> nodes_scanned{};
+};
+
+// Heap for memory allocation. The heap buffer immediately follows. Each heap
+// is owned by one process, which is the only one to allocate from it. Blocks
+// freed by the other process are returned through the remote free list.
 struct alignas(64) Heap {
 	int8_t magic[4] = { 'h', 'e', 'a', 'p' };
 	// Size of the heap and subsequent buffer.
 	uint32_t size = 0;
-	// Win32 mutex proteccting the heap.
-	uint32_t mutex_handle = 0;
 	// Offset from Heap to buffer.
 	uint32_t buffer_offset = sizeof(Heap);
+	// Number of bytes of the heap and buffer backed by committed memory. Pages
+	// beyond are only reserved and are committed by the owner on demand.
+	std::atomic_uint32_t committed_size{};
 	// Number of bytes allocated, up to (size - sizeof(Heap)).
 	uint32_t buffer_usage = 0;
-	// Hint offset from base of buffer to a free block.
-	uint32_t last_free_offset = 0;
+	// Offset from base of buffer to the last block freed without locking,
+	// either by the remote process or deferred by the owner. The blocks are
+	// linked through HeapNode::next_free_offset.
+	std::atomic_uint32_t remote_free_offset{ NULL_OFFSET };
+	// Allocation statistics.
+	HeapCounters counters;
+	// ID of the allocation policy used by the heap.
+	uint32_t policy = 0;
+	// Offset from base of buffer to the most recently freed block. Used by
+	// FirstFitPolicy.
+	uint32_t last_free_offset = NULL_OFFSET;
+	// Size of the largest free block, and whether that block has since been
+	// removed. Used by FirstFitPolicy.
+	uint32_t largest_free_size = 0;
+	uint32_t largest_free_stale = 0;
+	// Offset from base of buffer to the root of the free tree. Used by
+	// BestFitPolicy.
+	uint32_t free_root_offset = NULL_OFFSET;
+	// Bitmap of non-empty first-level size classes. The bins are used by
+	// SegregatedFitPolicy.
+	uint32_t fl_bitmap = 0;
+	// Bitmaps of non-empty second-level bins in each size class.
+	uint32_t sl_bitmap[HEAP_FL_COUNT] = {};
+	// Offsets from base of buffer to the first free block in each bin.
+	uint32_t free_bins[HEAP_BIN_COUNT];
+	// Size of the largest block in each bin, or zero if it must be found
+	// again after the largest block was removed.
+	uint32_t bin_max_size[HEAP_BIN_COUNT];
 };
 
 
 // Heap block is allocated.
 constexpr uint32_t HEAP_FLAG_ALLOCATED = 1;
+// Heap block holds a video frame, which the owner may recycle once freed.
+constexpr uint32_t HEAP_FLAG_FRAME = 2;
 
 struct alignas(64) HeapNode {
 	int8_t magic[4] = { 'm', 'e', 'm', 'z' };
 	uint32_t prev_node_offset = NULL_OFFSET;
 	uint32_t next_node_offset = NULL_OFFSET;
 	uint32_t flags = 0;
+	// Links to neighbouring blocks in the same bin, or to the left and right
+	// children in the free tree. Only valid if free.
+	uint32_t prev_free_offset = NULL_OFFSET;
+	uint32_t next_free_offset = NULL_OFFSET;
+	// Height of the subtree in the free tree. Only valid if free.
+	uint32_t free_height = 0;
+	// Number of references held by either process. Only valid if allocated.
+	std::atomic_uint32_t ref_count{ 0 };
+};
+
+static_assert(alignof(HeapNode) == 1U << HEAP_FL_SHIFT, "wrong alignment");
+static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t) && ATOMIC_INT_LOCK_FREE == 2, "shared memory atomics not supported");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && ATOMIC_LLONG_LOCK_FREE == 2, "shared memory atomics not supported");
+
+// Snapshot of the allocation statistics of a heap.
+struct HeapStats {
+	uint32_t capacity;
+	uint32_t committed;
+	uint32_t bytes_in_use;
+	uint32_t peak_bytes_in_use;
+	uint32_t live_blocks;
+	uint32_t largest_free_block;
+	uint32_t max_nodes_scanned;
+	uint32_t alloc_failures;
+	uint64_t alloc_count;
+	double avg_nodes_scanned;
+	// Fraction of free memory not usable by the largest possible allocation.
+	double fragmentation;
 };
 
 
-// Read available commands from queue. The buffer must be at least
-// (queue->buffer_usage) bytes. The caller must be holding the queue mutex.
-void queue_read(Queue *queue, void *buf);
+// Number of bytes of commands available to the reader.
+uint32_t queue_readable(const Queue *queue);
 
-// Write commands into queue. The caller must be holding the queue mutex.
+// Number of bytes that can be written without overwriting unread commands.
+uint32_t queue_writable(const Queue *queue);
+
+// Read (size) bytes of commands from queue, up to queue_readable. Only one
+// thread may read from a queue. Lock-free.
+void queue_read(Queue *queue, void *buf, uint32_t size);
+
+// Access (size) readable bytes starting (offset) bytes past the read position
+// without consuming them. Bytes that wrap around the end of the buffer are
+// copied to (scratch), which must hold (size) bytes. Only the reader may peek.
+const void *queue_peek(const Queue *queue, uint32_t offset, uint32_t size, void *scratch);
+
+// Release (size) bytes at the read position to the writer, up to
+// queue_readable. Only the reader may consume.
+void queue_consume(Queue *queue, uint32_t size);
+
+// Write commands into queue, up to queue_writable. The commands become visible
+// to the reader all at once. Only one thread may write to a queue. Lock-free.
 void queue_write(Queue *queue, const void *buf, uint32_t size);
 
-// Allocate a block from heap. The caller must be holding the heap mutex.
-HeapNode *heap_alloc(Heap *heap, uint32_t size);
+// Access (size) bytes of free space at the write position, up to
+// queue_writable, so that commands can be serialized in place. Returns null if
+// the space would wrap around the end of the buffer. Only the writer may
+// reserve.
+void *queue_reserve(Queue *queue, uint32_t size);
+
+// Publish (size) bytes written to the space returned by queue_reserve. Only the
+// writer may commit.
+void queue_commit(Queue *queue, uint32_t size);
+
+// Initialize the heap buffer as a single free block. The heap header must
+// already have been constructed and sized, and the header of the first block
+// must be committed.
+template <class Policy = HeapPolicy>
+void heap_init(Heap *heap);
+
+// Commit the heap up to (size) bytes from the heap header. Returns the new
+// committed size, which may be larger, or 0 if the memory is not available.
+typedef uint32_t (*HeapCommitCallback)(Heap *heap, uint32_t size);
+
+// Allocate a block from heap. Only the owner of the heap may allocate and the
+// caller must be holding its local heap lock. Memory is committed through the
+// callback before it is first touched. Without a callback, the entire heap
+// must be committed.
+template <class Policy = HeapPolicy>
+HeapNode *heap_alloc(Heap *heap, uint32_t size, HeapCommitCallback commit = nullptr);
+
+// Allocate a block whose payload, following the HeapNode, is aligned to the
+// given power of two. Any padding is left as a free block in front of it.
+template <class Policy = HeapPolicy>
+HeapNode *heap_alloc_aligned(Heap *heap, uint32_t size, uint32_t alignment, HeapCommitCallback commit = nullptr);
 
-// Return a block to heap. The caller must be holding the heap mutex.
+// Return a block to heap. Only the owner of the heap may free and the caller
+// must be holding its local heap lock.
+template <class Policy = HeapPolicy>
 void heap_free(Heap *heap, HeapNode *node);
 
+// Return a block to a heap without locking. The block is freed when the owner
+// next drains the list. Used for heaps owned by the remote process, and by the
+// owner to batch its own frees.
+void heap_free_remote(Heap *heap, HeapNode *node);
+
+// Offered each block returned through heap_free_remote before it is freed.
+// Returns true to keep the block allocated for reuse by the owner.
+typedef bool (*HeapRecycleCallback)(void *opaque, Heap *heap, HeapNode *node);
+
+// Free all blocks returned through heap_free_remote, except those kept by the
+// recycle callback. Only the owner of the heap may drain the list and the
+// caller must be holding its local heap lock. Returns the number of blocks
+// drained.
+template <class Policy = HeapPolicy>
+uint32_t heap_drain_remote(Heap *heap, HeapRecycleCallback recycle = nullptr, void *opaque = nullptr);
+
+// Add a reference to an allocated block. The caller must already hold a
+// reference. Either process may retain a block. Lock-free.
+void heap_retain(HeapNode *node);
+
+// Drop a reference to an allocated block. Returns true if it was the last
+// reference, in which case the caller must free the block. Lock-free.
+bool heap_release(HeapNode *node);
+
+// Recompute the statistics that are too costly to keep current on every
+// allocation, such as the largest free block. Only the owner of the heap may
+// update it and the caller must be holding its local heap lock.
+template <class Policy = HeapPolicy>
+void heap_update_stats(Heap *heap);
+
+// Read the allocation statistics of a heap. Does not require locking. The
+// largest free block is as of the owner's last heap_update_stats.
+HeapStats heap_stats(const Heap *heap);
+
+// Number of bytes usable in an allocated block.
+uint32_t heap_usable_size(const Heap *heap, const HeapNode *node);
+
 
 inline bool check_fourcc(const int8_t lhs[4], const char rhs[])
 {
@@ -0,0 +1,162 @@
+#pragma once
+
+#ifndef IPC_PLATFORM_H_
+#define IPC_PLATFORM_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _WIN32
+  #include "win32util.h"
+#else
+  #include <mutex>
+#endif
+
+namespace ipc {
+
+struct SharedEvent;
+
+} // namespace ipc
+
+
+// Operating system primitives used by IPCClient. Implemented with Win32 in
+// platform_win32.cpp, and with memfd, futexes and posix_spawn on Linux in
+// platform_posix.cpp.
+namespace ipc_client {
+namespace platform {
+
+#ifdef _WIN32
+typedef win32::detail::HANDLE native_handle;
+typedef wchar_t path_char;
+#else
+typedef int native_handle;
+typedef char path_char;
+#endif
+
+constexpr uint32_t INFINITE_WAIT = ~static_cast<uint32_t>(0);
+
+// Throw a std::system_error for the last error of the calling thread.
+[[noreturn]] void trap_error(const char *msg = "");
+
+// Last error of the calling thread, for logging.
+int last_error();
+
+unsigned processor_count();
+size_t page_size();
+
+// Pause in a polling loop.
+void cpu_relax();
+
+
+// The process at the other end of the connection. The master owns the slave
+// process and terminates it on destruction.
+class Process {
+	native_handle m_handle;
+	bool m_owned;
+#ifndef _WIN32
+	// Set once the owned process has been waited for. Its pid may then be
+	// reused, so it is not signaled again. The receiver and sender threads
+	// both check liveness, so waiting is serialized by the mutex.
+	mutable std::mutex m_wait_mutex;
+	mutable bool m_reaped;
+#endif
+public:
+#ifdef _WIN32
+	Process() : m_handle{}, m_owned{} {}
+
+	// Refer to the master process from the slave. The handle is not owned.
+	explicit Process(native_handle handle) : m_handle{ handle }, m_owned{} {}
+#else
+	Process() : m_handle{}, m_owned{}, m_reaped{} {}
+
+	// Refer to the master process from the slave. The handle is not owned.
+	explicit Process(native_handle handle) : m_handle{ handle }, m_owned{}, m_reaped{} {}
+#endif
+
+	Process(Process &&other) noexcept;
+
+	~Process();
+
+	Process &operator=(Process &&other) noexcept;
+
+	// Start the slave process, passing the id of the calling process and the
+	// shared memory handle and size on the command line. The shared memory
+	// handle is inherited by the slave.
+	static Process spawn_slave(const path_char *path, native_handle shmem_handle, uint32_t shmem_size);
+
+	native_handle handle() const { return m_handle; }
+	uint32_t id() const;
+	bool alive() const;
+
+	// Give the slave a moment to exit, then kill it.
+	void terminate();
+};
+
+
+// Section of shared memory mapped into both processes.
+class SharedMemory {
+	native_handle m_handle;
+	void *m_ptr;
+	size_t m_size;
+	bool m_large_pages;
+
+	void close();
+public:
+	SharedMemory() : m_handle{}, m_ptr{}, m_size{}, m_large_pages{} {}
+
+	SharedMemory(SharedMemory &&other) noexcept;
+
+	~SharedMemory() { close(); }
+
+	SharedMemory &operator=(SharedMemory &&other) noexcept;
+
+	// Reserve and map an inheritable section. Large page sections are
+	// committed in full and may be rounded up in size. Falls back to regular
+	// pages if large pages are not available.
+	static SharedMemory create(size_t size, bool large_pages);
+
+	// Map a section created by the master. Takes ownership of the handle.
+	static SharedMemory open(native_handle handle, size_t size);
+
+	native_handle handle() const { return m_handle; }
+	void *get() const { return m_ptr; }
+	size_t size() const { return m_size; }
+	bool large_pages() const { return m_large_pages; }
+};
+
+// Commit a reserved range of shared memory. Returns false on failure.
+bool commit_memory(void *ptr, size_t size);
+
+// Fault in a committed range, and optionally lock it into the working set.
+void warm_up_memory(const void *ptr, size_t size, bool lock);
+
+
+// Auto-reset event in shared memory. Each event has a single waiter.
+class Event {
+	ipc::SharedEvent *m_shared;
+#ifdef _WIN32
+	win32::unique_handle m_handle;
+#endif
+public:
+	Event() : m_shared{} {}
+
+	Event(const Event &) = delete;
+	Event &operator=(const Event &) = delete;
+
+	// Initialize an event in shared memory for both processes.
+	void create(ipc::SharedEvent *shared);
+
+	// Use an event created by the other process.
+	void open(ipc::SharedEvent *shared);
+
+	void set() const;
+
+	// Wait for the event to be set, up to (timeout) milliseconds. Throws if the
+	// remote process exits. Returns false on timeout.
+	bool wait(const Process &remote, uint32_t timeout = INFINITE_WAIT) const;
+};
+
+} // namespace platform
+} // namespace ipc_client
+
+#endif // IPC_PLATFORM_H_
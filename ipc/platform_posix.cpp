@@ -0,0 +1,326 @@
+#ifndef _WIN32
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <linux/futex.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ipc_client.h"
+#include "ipc_types.h"
+#include "logging.h"
+#include "platform.h"
+
+extern char **environ;
+
+namespace ipc_client {
+namespace platform {
+
+namespace {
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * (1UL << 20);
+
+// A futex can not wait on the remote process, so its liveness is checked at
+// this interval in milliseconds.
+constexpr uint32_t REMOTE_POLL_INTERVAL = 100;
+
+int futex(std::atomic_uint32_t *word, int op, uint32_t val, const struct timespec *timeout)
+{
+	static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t), "futex word must be 32 bits");
+	return static_cast<int>(::syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, val, timeout, nullptr, 0));
+}
+
+} // namespace
+
+
+void trap_error(const char *msg)
+{
+	std::error_code code{ errno, std::generic_category() };
+	throw std::system_error{ code, msg };
+}
+
+int last_error() { return errno; }
+
+unsigned processor_count()
+{
+	long count = ::sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? static_cast<unsigned>(count) : 1;
+}
+
+size_t page_size() { return static_cast<size_t>(::sysconf(_SC_PAGESIZE)); }
+
+void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+
+Process::Process(Process &&other) noexcept : m_handle{ other.m_handle }, m_owned{ other.m_owned }, m_reaped{ other.m_reaped }
+{
+	other.m_handle = 0;
+	other.m_owned = false;
+	other.m_reaped = false;
+}
+
+Process::~Process()
+{
+	std::lock_guard<std::mutex> lock{ m_wait_mutex };
+
+	if (m_owned && m_handle && !m_reaped) {
+		::kill(m_handle, SIGKILL);
+		::waitpid(m_handle, nullptr, 0);
+	}
+}
+
+Process &Process::operator=(Process &&other) noexcept
+{
+	std::lock(m_wait_mutex, other.m_wait_mutex);
+	std::lock_guard<std::mutex> lock{ m_wait_mutex, std::adopt_lock };
+	std::lock_guard<std::mutex> other_lock{ other.m_wait_mutex, std::adopt_lock };
+
+	std::swap(m_handle, other.m_handle);
+	std::swap(m_owned, other.m_owned);
+	std::swap(m_reaped, other.m_reaped);
+	return *this;
+}
+
+Process Process::spawn_slave(const char *path, int shmem_handle, uint32_t shmem_size)
+{
+	std::string pid_arg = std::to_string(::getpid());
+	std::string handle_arg = std::to_string(shmem_handle);
+	std::string size_arg = std::to_string(shmem_size);
+	char *argv[] = { const_cast<char *>(path), &pid_arg[0], &handle_arg[0], &size_arg[0], nullptr };
+
+	ipc_log("start slave process: %s %s %s %s\n", path, argv[1], argv[2], argv[3]);
+
+	// The memfd is close-on-exec, so that other processes do not inherit it.
+	// Duplicating it onto itself clears the flag in the slave only.
+	posix_spawn_file_actions_t file_actions;
+	int error = ::posix_spawn_file_actions_init(&file_actions);
+	if (error) {
+		errno = error;
+		trap_error("error starting slave process");
+	}
+
+	pid_t pid;
+	error = ::posix_spawn_file_actions_adddup2(&file_actions, shmem_handle, shmem_handle);
+	if (!error)
+		error = ::posix_spawn(&pid, path, &file_actions, nullptr, argv, environ);
+
+	::posix_spawn_file_actions_destroy(&file_actions);
+
+	if (error) {
+		errno = error;
+		trap_error("error starting slave process");
+	}
+
+	Process process{ pid };
+	process.m_owned = true;
+	return process;
+}
+
+uint32_t Process::id() const { return static_cast<uint32_t>(m_handle); }
+
+bool Process::alive() const
+{
+	// The slave is reparented when the master exits.
+	if (!m_owned)
+		return ::getppid() == m_handle;
+
+	std::lock_guard<std::mutex> lock{ m_wait_mutex };
+
+	if (m_reaped)
+		return false;
+
+	// A reaped pid may be reused, so remember that the slave is gone.
+	if (::waitpid(m_handle, nullptr, WNOHANG) == 0)
+		return true;
+
+	m_reaped = true;
+	return false;
+}
+
+void Process::terminate()
+{
+	if (!m_owned || !m_handle)
+		return;
+
+	std::lock_guard<std::mutex> lock{ m_wait_mutex };
+
+	if (!m_reaped) {
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 100 });
+		::kill(m_handle, SIGKILL);
+		::waitpid(m_handle, nullptr, 0);
+	}
+	m_handle = 0;
+	m_owned = false;
+	m_reaped = false;
+}
+
+
+SharedMemory::SharedMemory(SharedMemory &&other) noexcept :
+	m_handle{ other.m_handle },
+	m_ptr{ other.m_ptr },
+	m_size{ other.m_size },
+	m_large_pages{ other.m_large_pages }
+{
+	other.m_handle = 0;
+	other.m_ptr = nullptr;
+}
+
+SharedMemory &SharedMemory::operator=(SharedMemory &&other) noexcept
+{
+	std::swap(m_handle, other.m_handle);
+	std::swap(m_ptr, other.m_ptr);
+	std::swap(m_size, other.m_size);
+	std::swap(m_large_pages, other.m_large_pages);
+	return *this;
+}
+
+void SharedMemory::close()
+{
+	if (m_ptr)
+		::munmap(m_ptr, m_size);
+	if (m_handle > 0)
+		::close(m_handle);
+
+	m_ptr = nullptr;
+	m_handle = 0;
+}
+
+// The memfd is created close-on-exec, and only passed to the slave by
+// spawn_slave. Pages are allocated on first touch, so the section is
+// effectively reserved.
+SharedMemory SharedMemory::create(size_t size, bool large_pages)
+{
+	SharedMemory shmem;
+
+	if (large_pages) {
+		size_t rounded_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		int fd = ::memfd_create("avsw", MFD_CLOEXEC | MFD_HUGETLB);
+		void *ptr = MAP_FAILED;
+
+		if (fd >= 0 && !::ftruncate(fd, rounded_size))
+			ptr = ::mmap(nullptr, rounded_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+		if (ptr != MAP_FAILED) {
+			shmem.m_handle = fd;
+			shmem.m_ptr = ptr;
+			shmem.m_size = rounded_size;
+			shmem.m_large_pages = true;
+			return shmem;
+		}
+
+		ipc_log("large pages not available: %d\n", errno);
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	shmem.m_handle = ::memfd_create("avsw", MFD_CLOEXEC);
+	if (shmem.m_handle < 0)
+		trap_error("error allocating IPC shared memory");
+	if (::ftruncate(shmem.m_handle, size))
+		trap_error("error allocating IPC shared memory");
+
+	void *ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmem.m_handle, 0);
+	if (ptr == MAP_FAILED)
+		trap_error("error mapping shared memory");
+
+	shmem.m_ptr = ptr;
+	shmem.m_size = size;
+	return shmem;
+}
+
+SharedMemory SharedMemory::open(int handle, size_t size)
+{
+	SharedMemory shmem;
+	shmem.m_handle = handle;
+
+	void *ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+	if (ptr == MAP_FAILED)
+		trap_error("error mapping shared memory");
+
+	shmem.m_ptr = ptr;
+	shmem.m_size = size;
+	return shmem;
+}
+
+bool commit_memory(void *, size_t) { return true; }
+
+void warm_up_memory(const void *ptr, size_t size, bool lock)
+{
+	size_t page = page_size();
+
+	const volatile unsigned char *bytes = static_cast<const volatile unsigned char *>(ptr);
+	for (size_t i = 0; i < size; i += page) {
+		bytes[i];
+	}
+
+	if (lock && ::mlock(ptr, size))
+		ipc_log("error locking %zu bytes: %d\n", size, errno);
+}
+
+
+void Event::create(ipc::SharedEvent *shared)
+{
+	m_shared = shared;
+	m_shared->signaled.store(0, std::memory_order_relaxed);
+}
+
+void Event::open(ipc::SharedEvent *shared)
+{
+	m_shared = shared;
+}
+
+void Event::set() const
+{
+	// A waiter only sleeps while the word is clear, so there is nobody to wake
+	// if it was already set.
+	if (m_shared->signaled.exchange(1, std::memory_order_release))
+		return;
+	if (futex(&m_shared->signaled, FUTEX_WAKE, 1, nullptr) < 0)
+		trap_error("error setting event");
+}
+
+bool Event::wait(const Process &remote, uint32_t timeout) const
+{
+	auto start = std::chrono::steady_clock::now();
+
+	while (!m_shared->signaled.exchange(0, std::memory_order_acquire)) {
+		if (!remote.alive())
+			throw IPCError{ "remote process terminated unexpectedly" };
+
+		uint32_t interval = REMOTE_POLL_INTERVAL;
+
+		if (timeout != INFINITE_WAIT) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			if (elapsed >= timeout)
+				return false;
+			interval = timeout - elapsed < interval ? static_cast<uint32_t>(timeout - elapsed) : interval;
+		}
+
+		struct timespec ts{ interval / 1000, static_cast<long>(interval % 1000) * 1000000 };
+		if (futex(&m_shared->signaled, FUTEX_WAIT, 0, &ts) < 0 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+			trap_error("failed to wait for event");
+	}
+
+	return true;
+}
+
+} // namespace platform
+} // namespace ipc_client
+
+#endif // _WIN32
@@ -0,0 +1,321 @@
+#ifdef _WIN32
+
+#include <cstdint>
+#include <cwchar>
+#include <string>
+#include <utility>
+#include <Windows.h>
+#include "ipc_client.h"
+#include "ipc_types.h"
+#include "logging.h"
+#include "platform.h"
+#include "win32util.h"
+
+namespace ipc_client {
+namespace platform {
+
+static_assert(INFINITE_WAIT == INFINITE, "constant mismatch");
+
+namespace {
+
+std::wstring create_slave_command(const std::wstring &slave_path, ::HANDLE shmem_handle, uint32_t shmem_size)
+{
+#define FORMAT L"\"%s\" %u %u %u", slave_path.c_str(), ::GetCurrentProcessId(), HandleToULong(shmem_handle), shmem_size
+	if (slave_path.empty() || slave_path.find(L'"') != std::wstring::npos || slave_path.back() == L'/' || slave_path.back() == L'\\')
+		throw IPCError{ "invalid characters in path" };
+
+	std::wstring cmd(MAX_PATH, L'\0');
+
+	while (std::swprintf(&cmd[0], cmd.size(), FORMAT) < 0) {
+		cmd.resize(cmd.size() * 2);
+	}
+
+	return cmd;
+#undef FORMAT
+}
+
+// Large pages require SeLockMemoryPrivilege, which must be granted to the user
+// and then enabled in the process token.
+bool enable_lock_memory_privilege()
+{
+	::HANDLE token;
+	if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+
+	::TOKEN_PRIVILEGES privileges{ 1 };
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	bool success = ::LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		::AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+		::GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+
+	::CloseHandle(token);
+	return success;
+}
+
+} // namespace
+
+
+void trap_error(const char *msg) { win32::trap_error(msg); }
+
+int last_error() { return static_cast<int>(::GetLastError()); }
+
+unsigned processor_count()
+{
+	::SYSTEM_INFO system_info;
+	::GetSystemInfo(&system_info);
+	return system_info.dwNumberOfProcessors;
+}
+
+size_t page_size()
+{
+	::SYSTEM_INFO system_info;
+	::GetSystemInfo(&system_info);
+	return system_info.dwPageSize;
+}
+
+void cpu_relax() { YieldProcessor(); }
+
+
+Process::Process(Process &&other) noexcept : m_handle{ other.m_handle }, m_owned{ other.m_owned }
+{
+	other.m_handle = nullptr;
+	other.m_owned = false;
+}
+
+Process::~Process()
+{
+	if (m_owned && m_handle) {
+		::TerminateProcess(m_handle, 0);
+		::CloseHandle(m_handle);
+	}
+}
+
+Process &Process::operator=(Process &&other) noexcept
+{
+	std::swap(m_handle, other.m_handle);
+	std::swap(m_owned, other.m_owned);
+	return *this;
+}
+
+Process Process::spawn_slave(const wchar_t *path, ::HANDLE shmem_handle, uint32_t shmem_size)
+{
+	std::wstring slave_command = create_slave_command(path, shmem_handle, shmem_size);
+	ipc_wlog(L"start slave process: %s\n", slave_command.c_str());
+
+	::STARTUPINFO startup_info{ sizeof(::STARTUPINFO) };
+	::PROCESS_INFORMATION process_info{};
+
+#ifdef _DEBUG
+  #define FLAGS CREATE_NEW_CONSOLE
+#else
+  #define FLAGS CREATE_NO_WINDOW
+#endif
+	if (!::CreateProcessW(nullptr, &slave_command[0], nullptr, nullptr, TRUE, FLAGS, nullptr, nullptr, &startup_info, &process_info))
+		win32::trap_error("error starting slave process");
+#undef FLAGS
+
+	::CloseHandle(process_info.hThread);
+
+	Process process{ process_info.hProcess };
+	process.m_owned = true;
+	return process;
+}
+
+uint32_t Process::id() const { return ::GetProcessId(m_handle); }
+
+bool Process::alive() const
+{
+	::DWORD exit_code = STILL_ACTIVE;
+	if (!::GetExitCodeProcess(m_handle, &exit_code))
+		win32::trap_error("error polling remote process");
+	return exit_code == STILL_ACTIVE;
+}
+
+void Process::terminate()
+{
+	if (!m_owned || !m_handle)
+		return;
+
+	::Sleep(100);
+	::TerminateProcess(m_handle, 0);
+	::CloseHandle(m_handle);
+	m_handle = nullptr;
+	m_owned = false;
+}
+
+
+SharedMemory::SharedMemory(SharedMemory &&other) noexcept :
+	m_handle{ other.m_handle },
+	m_ptr{ other.m_ptr },
+	m_size{ other.m_size },
+	m_large_pages{ other.m_large_pages }
+{
+	other.m_handle = nullptr;
+	other.m_ptr = nullptr;
+}
+
+SharedMemory &SharedMemory::operator=(SharedMemory &&other) noexcept
+{
+	std::swap(m_handle, other.m_handle);
+	std::swap(m_ptr, other.m_ptr);
+	std::swap(m_size, other.m_size);
+	std::swap(m_large_pages, other.m_large_pages);
+	return *this;
+}
+
+void SharedMemory::close()
+{
+	if (m_ptr)
+		::UnmapViewOfFile(m_ptr);
+	if (m_handle)
+		::CloseHandle(m_handle);
+
+	m_ptr = nullptr;
+	m_handle = nullptr;
+}
+
+SharedMemory SharedMemory::create(size_t size, bool large_pages)
+{
+	::SECURITY_ATTRIBUTES inheritable_attributes{ sizeof(::SECURITY_ATTRIBUTES), nullptr, TRUE };
+	SharedMemory shmem;
+
+	// Large page sections can not be committed on demand, so they are
+	// committed in full.
+	if (large_pages) {
+		size_t large_page_size = ::GetLargePageMinimum();
+
+		if (large_page_size && enable_lock_memory_privilege()) {
+			size_t rounded_size = (size + large_page_size - 1) / large_page_size * large_page_size;
+			shmem.m_handle = ::CreateFileMappingW(INVALID_HANDLE_VALUE, &inheritable_attributes, PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES,
+			                                      0, static_cast<::DWORD>(rounded_size), nullptr);
+
+			if (shmem.m_handle)
+				size = rounded_size;
+			else
+				ipc_log("error allocating large pages: %u\n", ::GetLastError());
+		} else {
+			ipc_log0("large pages not available\n");
+		}
+
+		shmem.m_large_pages = !!shmem.m_handle;
+	}
+
+	if (!shmem.m_handle)
+		shmem.m_handle = ::CreateFileMappingW(INVALID_HANDLE_VALUE, &inheritable_attributes, PAGE_READWRITE | SEC_RESERVE, 0, static_cast<::DWORD>(size), nullptr);
+	if (!shmem.m_handle)
+		win32::trap_error("error allocating IPC shared memory");
+
+	shmem.m_ptr = ::MapViewOfFile(shmem.m_handle, FILE_MAP_READ | FILE_MAP_WRITE | (shmem.m_large_pages ? FILE_MAP_LARGE_PAGES : 0), 0, 0, size);
+	if (!shmem.m_ptr)
+		win32::trap_error("error mapping shared memory");
+
+	shmem.m_size = size;
+	return shmem;
+}
+
+SharedMemory SharedMemory::open(::HANDLE handle, size_t size)
+{
+	SharedMemory shmem;
+	shmem.m_handle = handle;
+
+	shmem.m_ptr = ::MapViewOfFile(handle, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size);
+	// Large page sections must be mapped with large pages.
+	if (!shmem.m_ptr) {
+		shmem.m_ptr = ::MapViewOfFile(handle, FILE_MAP_READ | FILE_MAP_WRITE | FILE_MAP_LARGE_PAGES, 0, 0, size);
+		shmem.m_large_pages = !!shmem.m_ptr;
+	}
+	if (!shmem.m_ptr)
+		win32::trap_error("error mapping shared memory");
+
+	shmem.m_size = size;
+	return shmem;
+}
+
+bool commit_memory(void *ptr, size_t size)
+{
+	return !!::VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+}
+
+// Demand-zero pages are faulted in separately by each process that maps them,
+// so reading one byte of each page is enough to map the range.
+void warm_up_memory(const void *ptr, size_t size, bool lock)
+{
+	size_t page = page_size();
+
+	const volatile unsigned char *bytes = static_cast<const volatile unsigned char *>(ptr);
+	for (size_t i = 0; i < size; i += page) {
+		bytes[i];
+	}
+
+	if (!lock)
+		return;
+
+	// The working set must be able to hold the locked pages.
+	::SIZE_T min_size, max_size;
+
+	if (!::GetProcessWorkingSetSize(::GetCurrentProcess(), &min_size, &max_size) ||
+	    !::SetProcessWorkingSetSize(::GetCurrentProcess(), min_size + size, max_size + size) ||
+	    !::VirtualLock(const_cast<void *>(ptr), size))
+	{
+		ipc_log("error locking %zu bytes: %u\n", size, ::GetLastError());
+	}
+}
+
+
+void Event::create(ipc::SharedEvent *shared)
+{
+	::SECURITY_ATTRIBUTES inheritable_attributes{ sizeof(::SECURITY_ATTRIBUTES), nullptr, TRUE };
+
+	m_handle.reset(::CreateEventW(&inheritable_attributes, FALSE, FALSE, nullptr));
+	if (!m_handle)
+		win32::trap_error("error creating synchronization object");
+
+	m_shared = shared;
+	m_shared->handle = HandleToULong(m_handle.get().h);
+}
+
+void Event::open(ipc::SharedEvent *shared)
+{
+	m_shared = shared;
+	m_handle.reset(ULongToHandle(m_shared->handle));
+}
+
+void Event::set() const
+{
+	if (!::SetEvent(m_handle.get().h))
+		win32::trap_error("error setting event");
+}
+
+bool Event::wait(const Process &remote, uint32_t timeout) const
+{
+	::HANDLE handles[2] = { m_handle.get().h, remote.handle() };
+	::DWORD result = ::WaitForMultipleObjects(sizeof(handles) / sizeof(::HANDLE), handles, FALSE, timeout);
+
+	switch (result) {
+	case WAIT_OBJECT_0:
+		return true;
+	case WAIT_OBJECT_0 + 1:
+		throw IPCError{ "remote process terminated unexpectedly" };
+	case WAIT_ABANDONED_0:
+	case WAIT_ABANDONED_0 + 1:
+		::SetLastError(ERROR_ABANDONED_WAIT_0);
+		win32::trap_error("remote process abandoned event");
+		break;
+	case WAIT_TIMEOUT:
+		return false;
+	case WAIT_FAILED:
+		win32::trap_error("failed to wait for event");
+		break;
+	default:
+		::SetLastError(ERROR_UNIDENTIFIED_ERROR);
+		win32::trap_error("unknown error while waiting on event");
+		break;
+	}
+	return false;
+}
+
+} // namespace platform
+} // namespace ipc_client
+
+#endif // _WIN32
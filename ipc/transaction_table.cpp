@@ -0,0 +1,110 @@
+#include <chrono>
+#include <thread>
+#include "ipc_client.h"
+#include "ipc_commands.h"
+#include "platform.h"
+#include "transaction_table.h"
+
+namespace ipc_client {
+
+void Callback::operator()(std::unique_ptr<Command> c)
+{
+	m_ops->invoke(m_storage, c);
+}
+
+
+TransactionTable::TransactionTable() :
+	m_slots{ new Slot[CAPACITY]{} },
+	m_next_id{}
+{}
+
+uint32_t TransactionTable::insert(Callback cb, uint32_t timeout)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned attempt = 0; ; ++attempt) {
+		for (uint32_t i = 0; i < CAPACITY; ++i) {
+			uint32_t transaction_id = m_next_id++;
+			if (transaction_id == INVALID_TRANSACTION)
+				transaction_id = m_next_id++;
+
+			Slot &s = slot(transaction_id);
+			uint32_t state = FREE;
+
+			if (!s.state.compare_exchange_strong(state, BUSY, std::memory_order_acquire))
+				continue;
+
+			s.transaction_id = transaction_id;
+			s.callback = std::move(cb);
+			s.state.store(PENDING, std::memory_order_release);
+			return transaction_id;
+		}
+
+		// Every slot is in use. Wait for responses to free some.
+		if (std::chrono::steady_clock::now() - start >= std::chrono::milliseconds{ timeout })
+			throw IPCError{ "too many transactions in flight" };
+
+		if (attempt < 16)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+	}
+}
+
+Callback TransactionTable::take(uint32_t transaction_id) noexcept
+{
+	Slot &s = slot(transaction_id);
+	uint32_t state = PENDING;
+
+	if (!s.state.compare_exchange_strong(state, BUSY, std::memory_order_acquire))
+		return nullptr;
+
+	// The slot belongs to a different transaction.
+	if (s.transaction_id != transaction_id) {
+		s.state.store(PENDING, std::memory_order_release);
+		return nullptr;
+	}
+
+	Callback cb = std::move(s.callback);
+	s.state.store(FREE, std::memory_order_release);
+	return cb;
+}
+
+void TransactionTable::cancel(uint32_t transaction_id) noexcept
+{
+	Slot &s = slot(transaction_id);
+
+	// The receiver may briefly hold the slot while it checks a stale response.
+	while (true) {
+		uint32_t state = PENDING;
+		if (s.state.compare_exchange_weak(state, BUSY, std::memory_order_acquire))
+			break;
+		if (state == FREE)
+			return;
+		platform::cpu_relax();
+	}
+
+	if (s.transaction_id == transaction_id) {
+		s.callback = nullptr;
+		s.state.store(FREE, std::memory_order_release);
+	} else {
+		s.state.store(PENDING, std::memory_order_release);
+	}
+}
+
+void TransactionTable::fail_all()
+{
+	for (uint32_t i = 0; i < CAPACITY; ++i) {
+		Slot &s = m_slots[i];
+		uint32_t state = PENDING;
+
+		if (!s.state.compare_exchange_strong(state, BUSY, std::memory_order_acquire))
+			continue;
+
+		Callback cb = std::move(s.callback);
+		s.state.store(FREE, std::memory_order_release);
+		cb(nullptr);
+	}
+}
+
+} // namespace ipc_client
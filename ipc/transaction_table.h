@@ -0,0 +1,170 @@
+#pragma once
+
+#ifndef IPC_TRANSACTION_TABLE_H_
+#define IPC_TRANSACTION_TABLE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ipc_client {
+
+class Command;
+
+// Move-only callable taking a command. Small callables, such as a function
+// pointer, a lambda capturing a few references, or a bound member function,
+// are stored inline. Larger ones are placed on the free store.
+class Callback {
+	static constexpr size_t STORAGE_SIZE = 6 * sizeof(void *);
+
+	struct Ops {
+		void (*invoke)(void *storage, std::unique_ptr<Command> &c);
+		void (*move)(void *dst, void *src) noexcept;
+		void (*destroy)(void *storage) noexcept;
+	};
+
+	template <class F>
+	struct InlineModel {
+		static void invoke(void *storage, std::unique_ptr<Command> &c) { (*static_cast<F *>(storage))(std::move(c)); }
+		static void move(void *dst, void *src) noexcept { new (dst) F(std::move(*static_cast<F *>(src))); static_cast<F *>(src)->~F(); }
+		static void destroy(void *storage) noexcept { static_cast<F *>(storage)->~F(); }
+		static const Ops ops;
+	};
+
+	template <class F>
+	struct HeapModel {
+		static F *&get(void *storage) { return *static_cast<F **>(storage); }
+
+		static void invoke(void *storage, std::unique_ptr<Command> &c) { (*get(storage))(std::move(c)); }
+		static void move(void *dst, void *src) noexcept { new (dst) F *{ get(src) }; }
+		static void destroy(void *storage) noexcept { delete get(storage); }
+		static const Ops ops;
+	};
+
+	template <class F>
+	using is_inline = std::integral_constant<bool,
+		sizeof(F) <= STORAGE_SIZE && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<F>::value>;
+
+	const Ops *m_ops;
+	alignas(std::max_align_t) unsigned char m_storage[STORAGE_SIZE];
+
+	template <class F>
+	void assign(F &&f, std::true_type)
+	{
+		new (m_storage) typename std::decay<F>::type(std::forward<F>(f));
+		m_ops = &InlineModel<typename std::decay<F>::type>::ops;
+	}
+
+	template <class F>
+	void assign(F &&f, std::false_type)
+	{
+		new (m_storage) typename std::decay<F>::type *{ new typename std::decay<F>::type(std::forward<F>(f)) };
+		m_ops = &HeapModel<typename std::decay<F>::type>::ops;
+	}
+
+	void reset() noexcept
+	{
+		if (m_ops)
+			m_ops->destroy(m_storage);
+		m_ops = nullptr;
+	}
+public:
+	Callback() noexcept : m_ops{} {}
+	Callback(std::nullptr_t) noexcept : m_ops{} {}
+
+	template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Callback>::value>::type>
+	Callback(F &&f) : m_ops{}
+	{
+		assign(std::forward<F>(f), is_inline<typename std::decay<F>::type>{});
+	}
+
+	Callback(Callback &&other) noexcept : m_ops{ other.m_ops }
+	{
+		if (m_ops)
+			m_ops->move(m_storage, other.m_storage);
+		other.m_ops = nullptr;
+	}
+
+	Callback(const Callback &) = delete;
+
+	~Callback() { reset(); }
+
+	Callback &operator=(Callback &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			m_ops = other.m_ops;
+			if (m_ops)
+				m_ops->move(m_storage, other.m_storage);
+			other.m_ops = nullptr;
+		}
+		return *this;
+	}
+
+	Callback &operator=(const Callback &) = delete;
+
+	explicit operator bool() const noexcept { return !!m_ops; }
+
+	void operator()(std::unique_ptr<Command> c);
+};
+
+template <class F>
+const Callback::Ops Callback::InlineModel<F>::ops = { &InlineModel<F>::invoke, &InlineModel<F>::move, &InlineModel<F>::destroy };
+
+template <class F>
+const Callback::Ops Callback::HeapModel<F>::ops = { &HeapModel<F>::invoke, &HeapModel<F>::move, &HeapModel<F>::destroy };
+
+
+// Callbacks of pending transactions, in a fixed table of slots indexed by the
+// transaction id modulo the capacity. The id stored in each slot serves as its
+// generation, so responses to an id that is no longer pending are detected.
+// Senders and the receiver only contend on the slot they use.
+class TransactionTable {
+public:
+	static constexpr uint32_t CAPACITY = 256;
+private:
+	enum : uint32_t {
+		FREE,
+		BUSY, // Being filled or emptied by a thread.
+		PENDING,
+	};
+
+	struct Slot {
+		std::atomic_uint32_t state;
+		uint32_t transaction_id;
+		Callback callback;
+	};
+
+	std::unique_ptr<Slot[]> m_slots;
+	std::atomic_uint32_t m_next_id;
+
+	Slot &slot(uint32_t transaction_id) const { return m_slots[transaction_id % CAPACITY]; }
+public:
+	TransactionTable();
+
+	TransactionTable(const TransactionTable &) = delete;
+	TransactionTable &operator=(const TransactionTable &) = delete;
+
+	// Allocate a transaction id and store its callback. Ids whose slot is still
+	// in use are skipped. If every slot is in use, waits up to (timeout)
+	// milliseconds for one to be freed, then throws IPCError.
+	uint32_t insert(Callback cb, uint32_t timeout);
+
+	// Remove the callback of a pending transaction. Returns an empty callback
+	// if the id is not pending.
+	Callback take(uint32_t transaction_id) noexcept;
+
+	// Drop the callback of a transaction that was never sent.
+	void cancel(uint32_t transaction_id) noexcept;
+
+	// Invoke the callbacks of all pending transactions with null.
+	void fail_all();
+};
+
+} // namespace ipc_client
+
+#endif // IPC_TRANSACTION_TABLE_H_
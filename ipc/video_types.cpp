@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include "video_types.h"
 
@@ -57,6 +58,18 @@ size_t serialize_chars(void *dst, const T *src, size_t len)
 } // namespace
 
 
+size_t video_frame_size(const VideoFrame &frame) noexcept
+{
+	size_t size = 0;
+
+	for (int p = 0; p < 4; ++p) {
+		if (frame.stride[p] > 0 && frame.height[p] > 0)
+			size += static_cast<size_t>(frame.stride[p]) * static_cast<size_t>(frame.height[p]);
+	}
+
+	return size;
+}
+
 size_t deserialize_str(char *dst, const void *src, size_t buf_size) noexcept
 {
 	return deserialize_chars(dst, src, buf_size);
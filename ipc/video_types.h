@@ -67,6 +67,9 @@ struct alignas(8) Value {
 };
 
 
+// Size of the frame buffer described by the strides and heights.
+size_t video_frame_size(const VideoFrame &frame) noexcept;
+
 // String functions.
 size_t deserialize_str(char *dst, const void *src, size_t buf_size) noexcept;
 size_t serialize_str(void *dst, const char *src, size_t len = -1) noexcept;